@@ -0,0 +1,696 @@
+#ifndef BENCHMARKEXPERIMENTS_H
+#define	BENCHMARKEXPERIMENTS_H
+
+#include "lmw/StdIncludes.h"
+#include "lmw/HammingKernels.h"
+#include "ExperimentTypedefs.h"
+#include "CreateSignatures.h"
+#include "StreamingEMTreeExperiments.h"
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#include "tbb/task_scheduler_init.h"
+
+/**
+ * Compares all Hamming distance kernels supported by this CPU on random bit
+ * vectors. Each kernel computes the distance between every pair of vectors
+ * in a small set that fits in cache, so the kernel rather than memory
+ * bandwidth is measured.
+ */
+void benchmarkHammingKernels() {
+    const vector<size_t> lengths = {640, 1024, 4096, 8192};
+    const size_t numVectors = 256;
+    const size_t repeats = 20;
+    cout << "selected kernel = " << HammingKernels::best().name << endl;
+    cout << "bits,kernel,nanoseconds per distance,checksum" << endl;
+    for (size_t length : lengths) {
+        vector<SVector<bool>*> vectors;
+        genData(vectors, length, numVectors);
+        const size_t numBlocks = vectors[0]->getNumBlocks();
+        for (const HammingKernel& kernel : HammingKernels::all()) {
+            if (!kernel.supported) {
+                continue;
+            }
+            uint64_t checksum = 0;
+            boost::timer::cpu_timer timer;
+            for (size_t r = 0; r < repeats; ++r) {
+                for (size_t i = 0; i < numVectors; ++i) {
+                    for (size_t j = 0; j < numVectors; ++j) {
+                        checksum += kernel.distance(vectors[i]->getData(),
+                                vectors[j]->getData(), numBlocks);
+                    }
+                }
+            }
+            timer.stop();
+            double distances = double(repeats * numVectors * numVectors);
+            cout << length << "," << kernel.name << ","
+                    << timer.elapsed().wall / distances << "," << checksum << endl;
+        }
+        Utils::purge(vectors);
+    }
+}
+
+/**
+ * Compares the generic euclideanDistanceSq and cosineDistance, which iterate
+ * over any vector type, with every float kernel supported by this CPU on
+ * random dense vectors. The generic path runs on std::vector<float> copies of
+ * the same vectors. The fused weighted add used by meanPrototype is timed for
+ * each kernel, where scalar is the loop SVector<float> used before.
+ */
+void benchmarkFloatKernels() {
+    const vector<size_t> dimensions = {100, 256, 768, 4096};
+    const size_t numVectors = 128;
+    const size_t repeats = 20;
+    RND_ENG eng(1234);
+    boost::random::uniform_real_distribution<float> uniform(-1, 1);
+    cout << "selected kernel = " << FloatKernels::best().name << endl;
+    cout << "dimensions,path,nanoseconds per squared distance,"
+            "nanoseconds per cosine,nanoseconds per weighted add,checksum" << endl;
+    for (size_t n : dimensions) {
+        vector<SVector<float>*> vectors;
+        vector<std::vector<float>*> generic;
+        for (size_t i = 0; i < numVectors; ++i) {
+            vectors.push_back(new SVector<float>(n));
+            generic.push_back(new std::vector<float>(n));
+            for (size_t j = 0; j < n; ++j) {
+                (*generic.back())[j] = vectors.back()->at(j) = uniform(eng);
+            }
+        }
+        const double pairs = double(repeats * numVectors * numVectors);
+        auto time = [&](std::function<double(size_t, size_t)> f, double* checksum) {
+            boost::timer::cpu_timer timer;
+            for (size_t r = 0; r < repeats; ++r) {
+                for (size_t i = 0; i < numVectors; ++i) {
+                    for (size_t j = 0; j < numVectors; ++j) {
+                        *checksum += f(i, j);
+                    }
+                }
+            }
+            return timer.elapsed().wall / pairs;
+        };
+        {
+            euclideanDistanceSq<std::vector<float>> squared;
+            cosineDistance<std::vector<float>> cosine;
+            double checksum = 0;
+            double squaredTime = time([&](size_t i, size_t j) {
+                return squared(generic[i], generic[j]);
+            }, &checksum);
+            double cosineTime = time([&](size_t i, size_t j) {
+                return cosine(generic[i], generic[j]);
+            }, &checksum);
+            cout << n << ",generic," << squaredTime << "," << cosineTime
+                    << ",," << checksum << endl;
+        }
+        SVector<float> sum(n);
+        for (const FloatKernel& kernel : FloatKernels::all()) {
+            if (!kernel.supported) {
+                continue;
+            }
+            double checksum = 0;
+            double squaredTime = time([&](size_t i, size_t j) {
+                return kernel.squaredDistance(vectors[i]->getData(),
+                        vectors[j]->getData(), vectors[i]->paddedSize());
+            }, &checksum);
+            double cosineTime = time([&](size_t i, size_t j) {
+                return 1 - kernel.cosine(vectors[i]->getData(),
+                        vectors[j]->getData(), vectors[i]->paddedSize());
+            }, &checksum);
+            sum.setAll(0);
+            double addTime = time([&](size_t i, size_t j) {
+                kernel.addMult(sum.getData(), vectors[j]->getData(), 1e-3f, n);
+                return 0.0;
+            }, &checksum);
+            cout << n << "," << kernel.name << "," << squaredTime << ","
+                    << cosineTime << "," << addTime << "," << checksum << endl;
+        }
+        Utils::purge(vectors);
+        Utils::purge(generic);
+    }
+}
+
+/**
+ * Compares finding the nearest of m keys one DISTANCE call at a time with the
+ * batched one-to-many search used by Optimizer::nearest.
+ */
+void benchmarkNearest() {
+    const vector<size_t> orders = {10, 100, 1000};
+    const size_t length = 4096;
+    const size_t numQueries = 10000;
+    vector<SVector<bool>*> queries;
+    genData(queries, length, numQueries);
+    cout << "keys,per key nanoseconds,batched nanoseconds" << endl;
+    for (size_t m : orders) {
+        vector<SVector<bool>*> keys;
+        genData(keys, length, m);
+        hammingDistance distance;
+        Minimize comp;
+        OPTIMIZER optimizer;
+        size_t checksum1 = 0, checksum2 = 0;
+        boost::timer::cpu_timer perKey;
+        for (auto query : queries) {
+            size_t nearestIndex = 0;
+            double nearestDistance = distance(query, keys[0]);
+            for (size_t i = 1; i < keys.size(); ++i) {
+                double currentDistance = distance(query, keys[i]);
+                if (comp(currentDistance, nearestDistance)) {
+                    nearestDistance = currentDistance;
+                    nearestIndex = i;
+                }
+            }
+            checksum1 += nearestIndex;
+        }
+        perKey.stop();
+        boost::timer::cpu_timer batched;
+        for (auto query : queries) {
+            checksum2 += optimizer.nearest(query, keys).index;
+        }
+        batched.stop();
+        if (checksum1 != checksum2) {
+            cout << "error - batched nearest search disagrees" << endl;
+        }
+        cout << m << "," << perKey.elapsed().wall / double(numQueries) << ","
+                << batched.elapsed().wall / double(numQueries) << endl;
+        Utils::purge(keys);
+    }
+    Utils::purge(queries);
+}
+
+/**
+ * Compares adding 4096 bit vectors to an SVector<uint32_t> one dimension at a
+ * time with adding them to a BitSlicedAccumulator. In StreamingEMTree this
+ * work is done while holding the lock for a cluster, so the time per vector
+ * is also the lock hold time.
+ */
+void benchmarkAccumulators() {
+    const size_t length = 4096;
+    const size_t numVectors = 10000;
+    const size_t repeats = 10;
+    vector<SVector<bool>*> vectors;
+    genData(vectors, length, numVectors);
+
+    SVector<uint32_t> counters(length);
+    counters.setAll(0);
+    boost::timer::cpu_timer perDimension;
+    for (size_t r = 0; r < repeats; ++r) {
+        for (auto vector : vectors) {
+            accumulate(counters, *vector);
+        }
+    }
+    perDimension.stop();
+
+    BitSlicedAccumulator bitSliced(length);
+    bitSliced.setAll(0);
+    boost::timer::cpu_timer sliced;
+    for (size_t r = 0; r < repeats; ++r) {
+        for (auto vector : vectors) {
+            accumulate(bitSliced, *vector);
+        }
+    }
+    bitSliced.flush();
+    sliced.stop();
+
+    for (size_t i = 0; i < length; ++i) {
+        if (counters[i] != bitSliced[i]) {
+            cout << "error - accumulators disagree at dimension " << i << endl;
+            break;
+        }
+    }
+    const double added = double(repeats * numVectors);
+    cout << "accumulator,nanoseconds per vector" << endl;
+    cout << "SVector<uint32_t>," << perDimension.elapsed().wall / added << endl;
+    cout << "BitSlicedAccumulator," << sliced.elapsed().wall / added << endl;
+    Utils::purge(vectors);
+}
+
+/**
+ * Compares Streaming EM-tree insert throughput on the 4096 bit Wikipedia
+ * signatures with and without keys packed into a KeyMatrix in each node.
+ */
+void benchmarkPackedKeys() {
+    StreamingEMTree_t* emtree = streamingEMTreeInit();
+    cout << "packed keys,vectors,seconds,vectors per second" << endl;
+    for (bool packedKeys : {false, true}) {
+        emtree->setPackedKeys(packedKeys);
+        SVectorStream<SVector<bool>> vs(options.docids, options.signatures,
+                options.signatureLength);
+        boost::timer::cpu_timer insert;
+        size_t read = emtree->insert(vs);
+        insert.stop();
+        double seconds = insert.elapsed().wall / 1e9;
+        cout << packedKeys << "," << read << "," << seconds << ","
+                << read / seconds << endl;
+        emtree->clearAccumulators();
+    }
+    delete emtree;
+}
+
+/**
+ * Measures how Streaming EM-tree insert throughput scales from 1 to 64 threads
+ * when leaf accumulators are locked and when each thread has its own
+ * accumulators that are merged afterwards. The signatures are read into
+ * memory first so that the disk is not measured. Merge time is included.
+ */
+void benchmarkThreadScaling() {
+    const size_t maxVectors = 1000000;
+    const size_t grainSize = 1000;
+    const vector<int> threadCounts = {1, 2, 4, 8, 16, 32, 64};
+    vector<SVector<bool>*> data;
+    {
+        SVectorStream<SVector<bool>> vs(options.docids, options.signatures,
+                options.signatureLength, maxVectors);
+        vs.read(maxVectors, &data);
+    }
+    StreamingEMTree_t* emtree = streamingEMTreeInit();
+    cout << "threads,thread local accumulators,seconds,vectors per second" << endl;
+    for (int threads : threadCounts) {
+        tbb::task_scheduler_init init(threads);
+        for (bool threadLocal : {false, true}) {
+            emtree->setThreadLocalAccumulators(threadLocal);
+            emtree->clearAccumulators();
+            boost::timer::cpu_timer insert;
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), grainSize),
+                    [&](const tbb::blocked_range<size_t>& r) {
+                        vector<SVector<bool>*> chunk(data.begin() + r.begin(),
+                                data.begin() + r.end());
+                        emtree->insert(chunk);
+                    }
+            );
+            emtree->mergeAccumulators();
+            insert.stop();
+            double seconds = insert.elapsed().wall / 1e9;
+            cout << threads << "," << threadLocal << "," << seconds << ","
+                    << data.size() / seconds << endl;
+        }
+    }
+    delete emtree;
+    Utils::purge(data);
+}
+
+/**
+ * Compares reading the 4096 bit Wikipedia signatures through SVectorStream,
+ * which copies every signature and ID, with MappedSVectorStream, which
+ * returns views into the mapped files. Each stream is read on its own and
+ * then inserted into a Streaming EM-tree. The IDs and signatures are checked
+ * to be the same.
+ */
+void benchmarkMappedStream() {
+    const size_t readSize = 1000;
+    SVectorStream<SVector<bool>> copying(options.docids, options.signatures,
+            options.signatureLength);
+    MappedSVectorStream mapped(options.docids, options.signatures,
+            options.signatureLength);
+    size_t total = 0;
+    double copyingSeconds = 0, mappedSeconds = 0;
+    for (;;) {
+        vector<SVector<bool>*> copied, views;
+        boost::timer::cpu_timer copyTimer;
+        size_t read = copying.read(readSize, &copied);
+        copyTimer.stop();
+        boost::timer::cpu_timer mappedTimer;
+        size_t mappedRead = mapped.read(readSize, &views);
+        mappedTimer.stop();
+        copyingSeconds += copyTimer.elapsed().wall / 1e9;
+        mappedSeconds += mappedTimer.elapsed().wall / 1e9;
+        bool same = read == mappedRead;
+        if (!same) {
+            cout << "error - streams read different numbers of vectors" << endl;
+        }
+        for (size_t i = 0; same && i < read; ++i) {
+            if (copied[i]->getID() != views[i]->getID() ||
+                    hammingDistance()(copied[i], views[i]) != 0) {
+                cout << "error - streams disagree at vector " << total + i << endl;
+                same = false;
+            }
+        }
+        copying.free(&copied);
+        mapped.free(&views);
+        if (!same) {
+            // the timings would not compare reading the same vectors
+            return;
+        }
+        if (read == 0) {
+            break;
+        }
+        total += read;
+    }
+    cout << "stream,vectors,read seconds,insert seconds" << endl;
+    StreamingEMTree_t* emtree = streamingEMTreeInit();
+    {
+        SVectorStream<SVector<bool>> vs(options.docids, options.signatures,
+                options.signatureLength);
+        boost::timer::cpu_timer insert;
+        emtree->insert(vs);
+        insert.stop();
+        cout << "SVectorStream," << total << "," << copyingSeconds << ","
+                << insert.elapsed().wall / 1e9 << endl;
+        emtree->clearAccumulators();
+    }
+    {
+        MappedSVectorStream vs(options.docids, options.signatures,
+                options.signatureLength);
+        boost::timer::cpu_timer insert;
+        emtree->insert(vs);
+        insert.stop();
+        cout << "MappedSVectorStream," << total << "," << mappedSeconds << ","
+                << insert.elapsed().wall / 1e9 << endl;
+    }
+    delete emtree;
+}
+
+/**
+ * Compares Streaming EM-tree insert throughput on the Wikipedia signature
+ * file (see convertWikiSignatures()) read by one thread through
+ * SignatureFileStream and by all threads through PartitionedSignatureStream.
+ */
+void benchmarkPartitionedStream() {
+    const string signatureFile = options.signatureFile;
+    const vector<int> threadCounts = {1, 2, 4, 8, 16, 32, 64};
+    SignatureFile file(signatureFile);
+    StreamingEMTree_t* emtree = streamingEMTreeInit();
+    cout << "threads,stream,vectors,seconds,vectors per second" << endl;
+    for (int threads : threadCounts) {
+        tbb::task_scheduler_init init(threads);
+        for (bool partitioned : {false, true}) {
+            boost::timer::cpu_timer insert;
+            size_t read;
+            if (partitioned) {
+                PartitionedSignatureStream vs(signatureFile);
+                read = emtree->insert(vs);
+            } else {
+                SignatureFileStream vs(file);
+                read = emtree->insert(vs);
+            }
+            insert.stop();
+            double seconds = insert.elapsed().wall / 1e9;
+            cout << threads << ","
+                    << (partitioned ? "PartitionedSignatureStream" : "SignatureFileStream")
+                    << "," << read << "," << seconds << "," << read / seconds << endl;
+            emtree->clearAccumulators();
+        }
+    }
+    delete emtree;
+}
+
+/**
+ * Compares SVectorStream allocating every signature and ID separately with
+ * storing each chunk in one BitVectorSlab, first reading the Wikipedia
+ * signatures alone and then inserting them into a Streaming EM-tree.
+ */
+void benchmarkSlabs() {
+    const size_t readSize = 1000;
+    StreamingEMTree_t* emtree = streamingEMTreeInit();
+    cout << "slabs,vectors,read seconds,insert seconds" << endl;
+    for (bool slabs : {false, true}) {
+        size_t total = 0;
+        boost::timer::cpu_timer read;
+        {
+            SVectorStream<SVector<bool>> vs(options.docids, options.signatures,
+                    options.signatureLength);
+            vs.setSlabs(slabs);
+            for (;;) {
+                vector<SVector<bool>*> data;
+                size_t n = vs.read(readSize, &data);
+                vs.free(&data);
+                if (n == 0) {
+                    break;
+                }
+                total += n;
+            }
+        }
+        read.stop();
+        SVectorStream<SVector<bool>> vs(options.docids, options.signatures,
+                options.signatureLength);
+        vs.setSlabs(slabs);
+        boost::timer::cpu_timer insert;
+        emtree->insert(vs);
+        insert.stop();
+        cout << slabs << "," << total << "," << read.elapsed().wall / 1e9 << ","
+                << insert.elapsed().wall / 1e9 << endl;
+        emtree->clearAccumulators();
+    }
+    delete emtree;
+}
+
+/**
+ * Compares Streaming EM-tree insert throughput on the Wikipedia signatures
+ * with fixed chunks of --read-size vectors and with adaptive chunks under
+ * several memory budgets.
+ */
+void benchmarkAdaptiveReadSize() {
+    const vector<size_t> budgets = {0, 256 << 20, 16 << 20, 1 << 20};
+    StreamingEMTree_t* emtree = streamingEMTreeInit();
+    cout << "read size,memory budget MiB,vectors,seconds,vectors per second" << endl;
+    for (int adaptive = 0; adaptive <= int(budgets.size()); ++adaptive) {
+        emtree->setAdaptiveReadSize(adaptive > 0);
+        emtree->setMemoryBudget(adaptive > 0 ? budgets[adaptive - 1] : 0);
+        MappedSVectorStream vs(options.docids, options.signatures,
+                options.signatureLength);
+        boost::timer::cpu_timer insert;
+        size_t read = emtree->insert(vs);
+        insert.stop();
+        double seconds = insert.elapsed().wall / 1e9;
+        cout << (adaptive > 0 ? "adaptive" : std::to_string(options.readSize))
+                << "," << (adaptive > 0 ? budgets[adaptive - 1] >> 20 : 0)
+                << "," << read << "," << seconds << "," << read / seconds << endl;
+        emtree->clearAccumulators();
+    }
+    delete emtree;
+}
+
+/**
+ * Generates clustered bit vectors by flipping random bits in copies of a few
+ * random prototypes.
+ */
+void genClusteredData(vector<SVector<bool>*>& vectors, const size_t length,
+        const size_t numVectors, const size_t numPrototypes, const size_t flips) {
+    vector<SVector<bool>*> prototypes;
+    genData(prototypes, length, numPrototypes);
+    for (size_t i = 0; i < numVectors; ++i) {
+        SVector<bool>* vector = new SVector<bool>(*prototypes[i % numPrototypes]);
+        for (size_t j = 0; j < flips; ++j) {
+            size_t bit = std::rand() % length;
+            vector->getData()[bit >> BITS_WS] ^= block_type(1) << (bit & MASK);
+        }
+        vectors.push_back(vector);
+    }
+    Utils::purge(prototypes);
+}
+
+/**
+ * Measures how EMTree::rearrange(), which pushes every vector in the tree
+ * back down to its nearest leaf, scales from 1 to 64 threads on clustered
+ * bit vectors.
+ */
+void benchmarkEMTreeRearrange() {
+    const vector<int> threadCounts = {1, 2, 4, 8, 16, 32, 64};
+    vector<SVector<bool>*> vectors;
+    genClusteredData(vectors, 4096, 500000, 1000, 400);
+    EMTree_t emtree(10);
+    emtree.seed(vectors, 3);
+    cout << "threads,vectors,seconds,vectors per second" << endl;
+    for (int threads : threadCounts) {
+        tbb::task_scheduler_init init(threads);
+        boost::timer::cpu_timer rearrange;
+        emtree.rearrange();
+        rearrange.stop();
+        double seconds = rearrange.elapsed().wall / 1e9;
+        cout << threads << "," << vectors.size() << "," << seconds << ","
+                << vectors.size() / seconds << endl;
+    }
+    Utils::purge(vectors);
+}
+
+/**
+ * Measures the throughput of building a K-tree of order 100 over clustered
+ * bit vectors. It compares adding the vectors one at a time with
+ * KTree::add(T*) against adding them concurrently with
+ * KTree::add(vector<T*>&) on 1 to 64 threads.
+ */
+void benchmarkKTreeInsertion() {
+    const vector<int> threadCounts = {1, 2, 4, 8, 16, 32, 64};
+    const int order = 100;
+    const int clustererMaxiters = 5;
+    vector<SVector<bool>*> vectors;
+    genClusteredData(vectors, 4096, 200000, 1000, 400);
+    cout << "threads,insertion,vectors,seconds,vectors per second,clusters,RMSE"
+            << endl;
+    for (int threads : threadCounts) {
+        tbb::task_scheduler_init init(threads);
+        for (bool concurrent : {false, true}) {
+            if (!concurrent && threads > 1) {
+                continue;
+            }
+            KTree_t ktree(order, clustererMaxiters);
+            boost::timer::cpu_timer insert;
+            if (concurrent) {
+                ktree.add(vectors);
+            } else {
+                for (SVector<bool>* vector : vectors) {
+                    ktree.add(vector);
+                }
+            }
+            insert.stop();
+            double seconds = insert.elapsed().wall / 1e9;
+            cout << threads << "," << (concurrent ? "concurrent" : "serial")
+                    << "," << vectors.size() << "," << seconds << ","
+                    << vectors.size() / seconds << "," << ktree.getClusterCount()
+                    << "," << ktree.getRMSE() << endl;
+        }
+    }
+    Utils::purge(vectors);
+}
+
+/**
+ * Compares building a K-tree of order 100 over clustered bit vectors by
+ * adding them one at a time, adding them concurrently and bulk loading them
+ * with KTree::bulkLoad(). It also reports adding the last 20% of the vectors
+ * concurrently to a tree bulk loaded from the rest.
+ */
+void benchmarkKTreeBulkLoad() {
+    const vector<int> threadCounts = {1, 2, 4, 8, 16, 32, 64};
+    const vector<string> builds = {"serial", "concurrent", "bulk", "bulk+concurrent"};
+    const int order = 100;
+    const int clustererMaxiters = 5;
+    vector<SVector<bool>*> vectors;
+    genClusteredData(vectors, 4096, 200000, 1000, 400);
+    vector<SVector<bool>*> loaded(vectors.begin(),
+            vectors.begin() + vectors.size() * 4 / 5);
+    vector<SVector<bool>*> added(vectors.begin() + loaded.size(), vectors.end());
+    cout << "threads,build,vectors,seconds,clusters,RMSE" << endl;
+    for (int threads : threadCounts) {
+        tbb::task_scheduler_init init(threads);
+        for (const string& build : builds) {
+            if (build == "serial" && threads > 1) {
+                continue;
+            }
+            KTree_t ktree(order, clustererMaxiters);
+            boost::timer::cpu_timer insert;
+            if (build == "serial") {
+                for (SVector<bool>* vector : vectors) {
+                    ktree.add(vector);
+                }
+            } else if (build == "concurrent") {
+                ktree.add(vectors);
+            } else if (build == "bulk") {
+                ktree.bulkLoad(vectors);
+            } else {
+                ktree.bulkLoad(loaded);
+                ktree.add(added);
+            }
+            insert.stop();
+            cout << threads << "," << build << "," << vectors.size() << ","
+                    << insert.elapsed().wall / 1e9 << ","
+                    << ktree.getClusterCount() << "," << ktree.getRMSE() << endl;
+        }
+    }
+    Utils::purge(vectors);
+}
+
+/**
+ * Compares k-means with and without triangle inequality bounds on clustered
+ * bit vectors. Each run starts from the same seed, so they must reach the
+ * same RMSE.
+ */
+void benchmarkKMeansBounds() {
+    const vector<int> clusterCounts = {10, 100, 1000};
+    vector<SVector<bool>*> vectors;
+    genClusteredData(vectors, 4096, 100000, 1000, 400);
+    const vector<TriangleBounds> bounds = {NO_BOUNDS, HAMERLY_BOUNDS, ELKAN_BOUNDS};
+    const vector<string> names = {"none", "Hamerly", "Elkan"};
+    cout << "k,bounds,RMSE,seconds" << endl;
+    for (int k : clusterCounts) {
+        for (size_t b = 0; b < bounds.size(); ++b) {
+            std::srand(1);
+            KMeans_t clusterer(k);
+            clusterer.setMaxIters(-1);
+            clusterer.setTriangleBounds(bounds[b]);
+            boost::timer::cpu_timer cluster;
+            clusterer.cluster(vectors);
+            cluster.stop();
+            cout << k << "," << names[b] << "," << clusterer.getRMSE() << ","
+                    << cluster.elapsed().wall / 1e9 << endl;
+        }
+    }
+    Utils::purge(vectors);
+}
+
+/**
+ * Seeds with SEEDER and reports the time taken, the RMSE of the seeds and
+ * the RMSE after 10 k-means iterations from them.
+ */
+template <typename SEEDER>
+void benchmarkSeeder(const string& name, vector<SVector<bool>*>& vectors,
+        const int k) {
+    typedef KMeans<vecType, SEEDER, OPTIMIZER> SeededKMeans;
+    double seedSeconds, seedRMSE;
+    {
+        SeededKMeans clusterer(k);
+        clusterer.setMaxIters(0);
+        boost::timer::cpu_timer seed;
+        clusterer.cluster(vectors);
+        seed.stop();
+        seedSeconds = seed.elapsed().wall / 1e9;
+        seedRMSE = clusterer.getRMSE();
+    }
+    SeededKMeans clusterer(k);
+    clusterer.setMaxIters(10);
+    clusterer.cluster(vectors);
+    cout << vectors.size() << "," << k << "," << name << "," << seedSeconds
+            << "," << seedRMSE << "," << clusterer.getRMSE() << endl;
+}
+
+/**
+ * Compares random, k-means++ (DSquaredSeeder) and k-means||
+ * (KMeansParallelSeeder) seeding on clustered bit vectors. The seconds
+ * include assigning all vectors to the seeds once.
+ */
+void benchmarkSeeders() {
+    const vector<int> clusterCounts = {100, 1000};
+    vector<SVector<bool>*> vectors;
+    genClusteredData(vectors, 4096, 100000, 1000, 400);
+    cout << "vectors,k,seeder,seconds,seed RMSE,10 iteration RMSE" << endl;
+    for (int k : clusterCounts) {
+        benchmarkSeeder<RandomSeeder_t>("random", vectors, k);
+        benchmarkSeeder<DSquaredSeeder_t>("k-means++", vectors, k);
+        benchmarkSeeder<KMeansParallelSeeder_t>("k-means||", vectors, k);
+    }
+    Utils::purge(vectors);
+}
+
+/**
+ * Compares KMeans with 10 full iterations to MiniBatchKMeans with 100
+ * batches of 1000 vectors on clustered bit vectors.
+ */
+void benchmarkMiniBatchKMeans() {
+    const vector<int> clusterCounts = {10, 100, 1000};
+    const vector<size_t> sizes = {100000, 1000000};
+    cout << "vectors,k,clusterer,RMSE,seconds" << endl;
+    for (size_t size : sizes) {
+        vector<SVector<bool>*> vectors;
+        genClusteredData(vectors, 4096, size, 1000, 400);
+        for (int k : clusterCounts) {
+            {
+                KMeans_t clusterer(k);
+                clusterer.setMaxIters(10);
+                boost::timer::cpu_timer cluster;
+                clusterer.cluster(vectors);
+                cluster.stop();
+                cout << size << "," << k << ",KMeans," << clusterer.getRMSE()
+                        << "," << cluster.elapsed().wall / 1e9 << endl;
+            }
+            {
+                MiniBatchKMeans_t clusterer(k);
+                clusterer.setMaxIters(100);
+                clusterer.setBatchSize(1000);
+                boost::timer::cpu_timer cluster;
+                clusterer.cluster(vectors);
+                cluster.stop();
+                cout << size << "," << k << ",MiniBatchKMeans," << clusterer.getRMSE()
+                        << "," << cluster.elapsed().wall / 1e9 << endl;
+            }
+        }
+        Utils::purge(vectors);
+    }
+}
+
+#endif	/* BENCHMARKEXPERIMENTS_H */
@@ -5,6 +5,7 @@
 #define	LOADSIGNATURES_H
 
 #include "lmw/StdIncludes.h"
+#include "Options.h"
 
 void genData(vector<SVector<bool>*> &vectors, size_t sigSize, size_t numVectors) {
 
@@ -60,10 +61,18 @@ void readSignatures(vector<SVector<bool>*> &vectors, string docidFile, string si
 }
 
 void loadWikiSignatures(vector<SVector<bool>*>& vectors, int veccount) {
-    const char docidFile[] = "data/wikisignatures/wiki.4096.docids";
-    const char signatureFile[] = "data/wikisignatures/wiki.4096.sig";
-    const size_t signatureLength = 4096;
-    readSignatures(vectors, docidFile, signatureFile, signatureLength, veccount);
+    readSignatures(vectors, options.docids, options.signatures,
+            options.signatureLength, veccount);
+}
+
+/**
+ * Converts the ID and signature files into a single signature file.
+ * See SignatureFile.h.
+ */
+void convertWikiSignatures() {
+    size_t count = convertSignatureFile(options.docids, options.signatures,
+            options.signatureLength, options.signatureFile);
+    cout << "converted " << count << " signatures to " << options.signatureFile << endl;
 }
 
 void loadSubset(vector<SVector<bool>*>& vectors, vector<SVector<bool>*>& subset,
@@ -0,0 +1,175 @@
+#ifndef DISTRIBUTEDEXPERIMENTS_H
+#define	DISTRIBUTEDEXPERIMENTS_H
+
+#include "lmw/StdIncludes.h"
+#include "ExperimentTypedefs.h"
+#include "StreamingEMTreeExperiments.h"
+#include "tbb/task_scheduler_init.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Runs f(0) to f(n - 1) each in its own child process and waits for all of
+ * them. Throws if any of them fails.
+ *
+ * TBB must not be used in a process after it forks, so the parent of a
+ * distributed run only forks and waits. Everything else happens in children.
+ */
+void runChildProcesses(const size_t n, const std::function<void(size_t)>& f) {
+    cout << flush;
+    vector<pid_t> children;
+    for (size_t i = 0; i < n; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            throw runtime_error("fork failed");
+        }
+        if (pid == 0) {
+            int status = 0;
+            try {
+                f(i);
+            } catch (const std::exception& e) {
+                cout << "process " << i << " failed: " << e.what() << endl;
+                status = 1;
+            }
+            cout << flush;
+            _exit(status);
+        }
+        children.push_back(pid);
+    }
+    bool failed = false;
+    for (pid_t pid : children) {
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status)
+                || WEXITSTATUS(status) != 0) {
+            failed = true;
+        }
+    }
+    if (failed) {
+        throw runtime_error("a child process failed");
+    }
+}
+
+string distributedAccumulators(const size_t worker) {
+    return options.accumulators + "." + std::to_string(worker);
+}
+
+/**
+ * Inserts worker's share of signatureFile into the tree in the checkpoint on
+ * threads threads and saves the accumulators.
+ */
+void streamingEMTreeWorker(const string& signatureFile, const size_t worker,
+        const size_t workers, const int threads) {
+    unique_ptr<StreamingEMTree_t> emtree(StreamingEMTree_t::load(options.checkpoint));
+    emtree->clearAccumulators();
+    SignatureFile file(signatureFile);
+    const size_t begin = file.size() * worker / workers;
+    const size_t end = file.size() * (worker + 1) / workers;
+    SignatureFileStream vs(file, begin, end);
+    configure(emtree.get());
+    emtree->setThreads(threads);
+    size_t read = emtree->insert(vs);
+    emtree->saveAccumulators(distributedAccumulators(worker));
+    cout << "worker " << worker << " inserted " << read << " vectors" << endl;
+}
+
+/**
+ * Adds the accumulators from all workers into the tree in the checkpoint,
+ * updates it and saves it as the checkpoint for the next iteration.
+ */
+void streamingEMTreeReduce(const size_t workers) {
+    StreamingEMTree_t::Progress progress;
+    unique_ptr<StreamingEMTree_t> emtree(StreamingEMTree_t::load(
+            options.checkpoint, &progress));
+    emtree->clearAccumulators();
+    {
+        boost::timer::auto_cpu_timer reduce("adding worker accumulators: %w seconds\n");
+        for (size_t worker = 0; worker < workers; worker++) {
+            emtree->addAccumulators(distributedAccumulators(worker));
+        }
+    }
+    cout << emtree->prune() << " nodes pruned" << endl;
+    report(emtree.get());
+    {
+        boost::timer::auto_cpu_timer update("update streaming EM-tree: %w seconds\n");
+        emtree->update();
+        emtree->clearAccumulators();
+    }
+    progress.iteration++;
+    emtree->save(options.checkpoint, progress);
+}
+
+/**
+ * Writes the cluster of every vector in signatureFile using the tree in the
+ * checkpoint, as the last iteration of streamingEMTree() does.
+ */
+void streamingEMTreeWriteClusters(const string& signatureFile) {
+    unique_ptr<StreamingEMTree_t> emtree(StreamingEMTree_t::load(options.checkpoint));
+    emtree->clearAccumulators();
+    configure(emtree.get());
+    SignatureFile file(signatureFile);
+    SignatureFileStream vs(file);
+    insertWriteClusters(emtree.get(), vs);
+}
+
+/**
+ * Streaming EM-tree over the Wikipedia signature file (see
+ * convertWikiSignatures()) using several worker processes. Each iteration,
+ * every worker loads the tree from a checkpoint, inserts its share of the
+ * signatures and saves its accumulators. A reducer process adds them up,
+ * updates the tree and saves the next checkpoint, which is how the new keys
+ * reach the workers.
+ *
+ * The last iteration writes the cluster assignments from one process
+ * instead. Files are the only transport, so with a shared file system the
+ * workers could as well be on different machines. A run that is stopped
+ * resumes from the last checkpoint with --resume (see shouldResume()).
+ */
+void distributedStreamingEMTree() {
+    const string signatureFile = options.signatureFile;
+    const size_t workers = options.workers;
+    const uint64_t maxIters = options.iterations;
+    const int threadsPerWorker = options.threads > 0 ? options.threads
+            : std::max(1, tbb::task_scheduler_init::default_num_threads() / int(workers));
+
+    if (!shouldResume()) {
+        runChildProcesses(1, [&](size_t) {
+            unique_ptr<StreamingEMTree_t> emtree(streamingEMTreeInit());
+            StreamingEMTree_t::Progress progress;
+            progress.job = jobFingerprint();
+            emtree->save(options.checkpoint, progress);
+        });
+    }
+    for (;;) {
+        auto progress = StreamingEMTree_t::loadProgress(options.checkpoint);
+        if (progress.iteration >= maxIters - 1) {
+            break;
+        }
+        cout << "ITERATION " << progress.iteration << endl;
+        {
+            boost::timer::auto_cpu_timer insert("inserting in worker processes: %w seconds\n");
+            runChildProcesses(workers, [&](size_t worker) {
+                tbb::task_scheduler_init init(threadsPerWorker);
+                streamingEMTreeWorker(signatureFile, worker, workers, threadsPerWorker);
+            });
+        }
+        runChildProcesses(1, [&](size_t) {
+            streamingEMTreeReduce(workers);
+        });
+        cout << "-----" << endl << endl;
+    }
+
+    // last iteration writes cluster assignments and does not update accumulators
+    runChildProcesses(1, [&](size_t) {
+        tbb::task_scheduler_init init(options.threads > 0 ? options.threads
+                : tbb::task_scheduler_init::automatic);
+        streamingEMTreeWriteClusters(signatureFile);
+    });
+    removeCheckpoint();
+    for (size_t worker = 0; worker < workers; worker++) {
+        std::remove(distributedAccumulators(worker).c_str());
+    }
+}
+
+#endif	/* DISTRIBUTEDEXPERIMENTS_H */
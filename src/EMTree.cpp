@@ -2,21 +2,55 @@
 //
 
 #include "ExperimentTypedefs.h"
+#include "Options.h"
 #include "CreateSignatures.h"
 #include "StreamingEMTreeExperiments.h"
 #include "JournalPaperExperiments.h"
 #include "GeneralExperiments.h"
+#include "BenchmarkExperiments.h"
+#include "DistributedExperiments.h"
 
-int main(int argc, char** argv) {
-    std::srand(std::time(0));
+/**
+ * Runs options.algorithm and returns the exit status. Errors are thrown.
+ */
+int runAlgorithm() {
+    // The distributed parent process must not start TBB before it forks, and
+    // benchmarks choose their own thread counts.
+    const string& algorithm = options.algorithm;
+    unique_ptr<tbb::task_scheduler_init> init;
+    if (options.threads > 0 && algorithm != "distributed-streaming-emtree"
+            && algorithm != "benchmark") {
+        init.reset(new tbb::task_scheduler_init(options.threads));
+    }
 
-    if (false) {
+    if (algorithm == "streaming-minibatch-emtree") {
         streamingMiniBatchEMTree();
-    } else if (true) {
+    } else if (algorithm == "streaming-emtree") {
         streamingEMTree();
-    } else if (false) {
+    } else if (algorithm == "clueweb") {
         clueweb();
-    } else {
+    } else if (algorithm == "benchmark") {
+        benchmarkHammingKernels();
+        benchmarkFloatKernels();
+        benchmarkNearest();
+        benchmarkPackedKeys();
+        benchmarkAccumulators();
+        benchmarkThreadScaling();
+        benchmarkMappedStream();
+        benchmarkPartitionedStream();
+        benchmarkAdaptiveReadSize();
+        benchmarkSlabs();
+        benchmarkEMTreeRearrange();
+        benchmarkKTreeInsertion();
+        benchmarkKTreeBulkLoad();
+        benchmarkKMeansBounds();
+        benchmarkMiniBatchKMeans();
+        benchmarkSeeders();
+    } else if (algorithm == "convert-signatures") {
+        convertWikiSignatures();
+    } else if (algorithm == "distributed-streaming-emtree") {
+        distributedStreamingEMTree();
+    } else if (algorithm == "kmeans") {
         // load data
         vector < SVector<bool>*> vectors;
         int veccount = -1;
@@ -29,7 +63,7 @@ int main(int argc, char** argv) {
         vector < SVector<bool>*> subset;
         {
             boost::timer::auto_cpu_timer load("filtering subset: %w seconds\n");
-            loadSubset(vectors, subset, "data/inex_xml_mining_subset_2010.txt");
+            loadSubset(vectors, subset, options.subset);
         }
 
         // run experiments
@@ -50,9 +84,26 @@ int main(int argc, char** argv) {
         for (auto v : vectors) {
             delete v;
         }
+    } else {
+        cout << "error - unknown algorithm " << algorithm << ", see --help" << endl;
+        return EXIT_FAILURE;
     }
 
     return EXIT_SUCCESS;
 }
 
+int main(int argc, char** argv) {
+    std::srand(std::time(0));
+
+    try {
+        if (!parseOptions(argc, argv, options)) {
+            return EXIT_SUCCESS;
+        }
+        return runAlgorithm();
+    } catch (const std::exception& e) {
+        cout << "error - " << e.what() << endl;
+        return EXIT_FAILURE;
+    }
+}
+
 
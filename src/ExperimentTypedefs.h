@@ -9,16 +9,23 @@
 #include "lmw/Seeder.h"
 #include "lmw/DSquaredSeeder.h"
 #include "lmw/RandomSeeder.h"
+#include "lmw/KMeansParallelSeeder.h"
 #include "lmw/VectorGenerator.h"
 #include "lmw/StdIncludes.h"
 #include "lmw/SVectorStream.h"
+#include "lmw/MappedSVectorStream.h"
+#include "lmw/SignatureFile.h"
+#include "lmw/PartitionedSignatureStream.h"
+#include "lmw/BitSlicedAccumulator.h"
 #include "lmw/Optimizer.h"
 
 #include "lmw/KMeans.h"
+#include "lmw/MiniBatchKMeans.h"
 #include "lmw/TSVQ.h"
 #include "lmw/KTree.h"
 #include "lmw/EMTree.h"
 #include "lmw/StreamingEMTree.h"
+#include "lmw/LMWTree.h"
 
 using namespace lmw;
 
@@ -29,8 +36,15 @@ typedef KMeans<vecType, RandomSeeder_t, OPTIMIZER> KMeans_t;
 typedef TSVQ<vecType, KMeans_t, hammingDistance> TSVQ_t;
 typedef KTree<vecType, KMeans_t, OPTIMIZER> KTree_t;
 typedef EMTree<vecType, KMeans_t, OPTIMIZER> EMTree_t;
-typedef SVector<uint32_t> ACCUMULATOR;
+typedef BitSlicedAccumulator ACCUMULATOR;
 typedef StreamingEMTree<vecType, ACCUMULATOR, OPTIMIZER> StreamingEMTree_t;
+typedef MiniBatchKMeans<vecType, RandomSeeder_t, OPTIMIZER> MiniBatchKMeans_t;
+typedef TSVQ<vecType, MiniBatchKMeans_t, hammingDistance> MiniBatchTSVQ_t;
+typedef EMTree<vecType, MiniBatchKMeans_t, OPTIMIZER> MiniBatchEMTree_t;
+typedef DSquaredSeeder<vecType, hammingDistance> DSquaredSeeder_t;
+typedef KMeansParallelSeeder<vecType, hammingDistance> KMeansParallelSeeder_t;
+typedef KMeans<vecType, KMeansParallelSeeder_t, OPTIMIZER> ParallelSeededKMeans_t;
+typedef TSVQ<vecType, ParallelSeededKMeans_t, hammingDistance> ParallelSeededTSVQ_t;
 
 #endif	/* EXPERIMENTTYPEDEFS_H */
 
@@ -0,0 +1,127 @@
+#ifndef OPTIONS_H
+#define	OPTIONS_H
+
+#include "lmw/StdIncludes.h"
+
+namespace po = boost::program_options;
+
+/**
+ * The parameters of a clustering job. The defaults are the values the
+ * experiments were written with, so running emtree without arguments does
+ * what it always did. parseOptions() sets them from the command line.
+ */
+struct Options {
+    string algorithm = "streaming-emtree";
+
+    // input
+    string docids = "data/wikisignatures/wiki.4096.docids";
+    string signatures = "data/wikisignatures/wiki.4096.sig";
+    string signatureFile = "data/wikisignatures/wiki.4096.lmwsig";
+    size_t signatureLength = 4096;
+    string subset = "data/inex_xml_mining_subset_2010.txt";
+
+    // tree shape and iterations
+    int order = 10;
+    int depth = 4;
+    int iterations = 0; // 0 for the default of the algorithm, see parseOptions()
+    size_t batchSize = 100000;
+
+    // throughput
+    int threads = 0;
+    int readSize = 1000;
+    int maxTokens = 1024;
+    bool adaptiveReadSize = false;
+    size_t memoryBudget = 0; // MiB
+    size_t workers = 4;
+
+    // output
+    string outputPrefix = "wikipedia_clusters";
+    string checkpoint = "streaming_emtree.checkpoint";
+    string accumulators = "distributed_emtree.accumulators";
+    bool resume = false;
+};
+
+/**
+ * The options of this run. It is only set by main().
+ */
+Options options;
+
+/**
+ * Sets options from the command line.
+ *
+ * @return false if the program should exit, because --help was given
+ */
+bool parseOptions(int argc, char** argv, Options& options) {
+    po::options_description description("Usage: emtree [options]");
+    description.add_options()
+            ("help,h", "print this message")
+            ("algorithm,a", po::value<string>(&options.algorithm)->default_value(options.algorithm),
+            "streaming-emtree, streaming-minibatch-emtree, "
+            "distributed-streaming-emtree, kmeans, clueweb, "
+            "convert-signatures or benchmark")
+            ("docids", po::value<string>(&options.docids)->default_value(options.docids),
+            "file with one document ID per line")
+            ("signatures", po::value<string>(&options.signatures)->default_value(options.signatures),
+            "file of binary signatures in the same order as --docids")
+            ("signature-file", po::value<string>(&options.signatureFile)->default_value(options.signatureFile),
+            "signature container (see lmw/SignatureFile.h), written by "
+            "convert-signatures and read by distributed-streaming-emtree")
+            ("signature-length", po::value<size_t>(&options.signatureLength)->default_value(options.signatureLength),
+            "bits per signature")
+            ("subset", po::value<string>(&options.subset)->default_value(options.subset),
+            "document IDs of the sample used to build the initial tree")
+            ("order,m", po::value<int>(&options.order)->default_value(options.order),
+            "tree order, i.e. the number of clusters per node")
+            ("depth,d", po::value<int>(&options.depth)->default_value(options.depth),
+            "depth of the initial tree")
+            ("iterations,i", po::value<int>(&options.iterations)->default_value(options.iterations),
+            "iterations over the data, or 0 for the default of the algorithm: "
+            "2 for streaming-minibatch-emtree and 10 otherwise")
+            ("batch-size", po::value<size_t>(&options.batchSize)->default_value(options.batchSize),
+            "vectors per batch for streaming-minibatch-emtree")
+            ("threads,t", po::value<int>(&options.threads)->default_value(options.threads),
+            "threads, or 0 for one per core")
+            ("read-size", po::value<int>(&options.readSize)->default_value(options.readSize),
+            "vectors read from disk at once by the streaming EM-tree")
+            ("max-tokens", po::value<int>(&options.maxTokens)->default_value(options.maxTokens),
+            "read-size chunks the streaming EM-tree holds in memory at once")
+            ("adaptive-read-size", po::bool_switch(&options.adaptiveReadSize),
+            "size chunks by their measured processing time rather than "
+            "--read-size, with a few chunks per thread in memory")
+            ("memory-budget", po::value<size_t>(&options.memoryBudget)->default_value(options.memoryBudget),
+            "MiB of vectors in memory at once with --adaptive-read-size, "
+            "or 0 for no limit")
+            ("workers", po::value<size_t>(&options.workers)->default_value(options.workers),
+            "worker processes for distributed-streaming-emtree")
+            ("output-prefix,o", po::value<string>(&options.outputPrefix)->default_value(options.outputPrefix),
+            "prefix of the cluster files written")
+            ("checkpoint", po::value<string>(&options.checkpoint)->default_value(options.checkpoint),
+            "checkpoint file saved while a streaming EM-tree runs and removed "
+            "when it completes")
+            ("accumulators", po::value<string>(&options.accumulators)->default_value(options.accumulators),
+            "prefix of the files distributed-streaming-emtree workers save "
+            "their accumulators to, followed by the worker number")
+            ("resume", po::bool_switch(&options.resume),
+            "resume from --checkpoint if it exists, which must have been "
+            "saved by a run with the same algorithm, input and tree shape");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, description), vm);
+    if (vm.count("help")) {
+        cout << description << endl;
+        return false;
+    }
+    po::notify(vm);
+    if (options.iterations == 0) {
+        options.iterations = options.algorithm == "streaming-minibatch-emtree" ? 2 : 10;
+    }
+    if (options.order < 2 || options.depth < 1 || options.iterations < 1
+            || options.readSize < 1 || options.maxTokens < 1
+            || options.threads < 0 || options.workers < 1
+            || options.signatureLength == 0 || options.signatureLength % 64 != 0) {
+        throw runtime_error("invalid option value, see --help");
+    }
+    return true;
+}
+
+#endif	/* OPTIONS_H */
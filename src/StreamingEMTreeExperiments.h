@@ -2,12 +2,25 @@
 #define	STREAMINGEMTREEEXPERIMENTS_H
 
 #include "CreateSignatures.h"
+#include "Options.h"
 #include "lmw/StdIncludes.h"
 #include "lmw/ClusterVisitor.h"
 #include "lmw/InsertVisitor.h"
 #include "tbb/mutex.h"
 #include "tbb/task_scheduler_init.h"
 #include "lmw/StreamingEMTree.h"
+#include "lmw/SignatureFile.h"
+
+/**
+ * Applies the throughput options to a tree.
+ */
+void configure(StreamingEMTree_t* emtree) {
+    emtree->setReadSize(options.readSize);
+    emtree->setMaxTokens(options.maxTokens);
+    emtree->setAdaptiveReadSize(options.adaptiveReadSize);
+    emtree->setMemoryBudget(options.memoryBudget * 1024 * 1024);
+    emtree->setThreads(options.threads);
+}
 
 StreamingEMTree_t* streamingEMTreeInit() {
     // load data
@@ -22,12 +35,12 @@ StreamingEMTree_t* streamingEMTreeInit() {
     vector < SVector<bool>*> subset;
     {
         boost::timer::auto_cpu_timer load("filtering subset: %w seconds\n");
-        loadSubset(vectors, subset, "data/inex_xml_mining_subset_2010.txt");
+        loadSubset(vectors, subset, options.subset);
     }
 
     // run TSVQ to build tree on sample
-    const int m = 10;
-    const int depth = 4;
+    const int m = options.order;
+    const int depth = options.depth;
     const int maxiter = 0;
     TSVQ_t tsvq(m, depth, maxiter);
 
@@ -39,6 +52,7 @@ StreamingEMTree_t* streamingEMTreeInit() {
     cout << "initializing streaming EM-tree based on TSVQ subset sample" << endl;
     cout << "TSVQ iterations = " << maxiter << endl;
     auto tree = new StreamingEMTree_t(tsvq.getMWayTree());
+    configure(tree);
 
     for (auto v : vectors) {
         delete v;
@@ -47,9 +61,72 @@ StreamingEMTree_t* streamingEMTreeInit() {
     return tree;
 }
 
-const char wikiDocidFile[] = "data/wikisignatures/wiki.4096.docids";
-const char wikiSignatureFile[] = "data/wikisignatures/wiki.4096.sig";
-const size_t wikiSignatureLength = 4096;
+/**
+ * Identifies a run by the settings a checkpoint must have been saved with
+ * to be resumed: the algorithm, the input and the shape of the tree.
+ */
+uint64_t jobFingerprint() {
+    std::ostringstream job;
+    job << options.algorithm << '\n' << options.docids << '\n'
+            << options.signatures << '\n' << options.signatureFile << '\n'
+            << options.signatureLength << '\n' << options.subset << '\n'
+            << options.order << '\n' << options.depth << '\n'
+            << options.batchSize;
+    const string settings = job.str();
+    return SignatureFileFormat::checksumBytes(SignatureFileFormat::checksumBasis,
+            settings.data(), settings.size());
+}
+
+/**
+ * Whether to resume from the checkpoint. It is only resumed if --resume was
+ * given and it was saved by the same job. A checkpoint left by an unfinished
+ * run is not overwritten unless it is resumed.
+ */
+bool shouldResume() {
+    if (!ifstream(options.checkpoint)) {
+        return false;
+    }
+    if (!options.resume) {
+        throw runtime_error(options.checkpoint + " was left by an unfinished "
+                "run, pass --resume to continue it or remove it");
+    }
+    if (StreamingEMTree_t::loadProgress(options.checkpoint).job != jobFingerprint()) {
+        throw runtime_error(options.checkpoint + " was saved by a run with a "
+                "different algorithm, input or tree shape");
+    }
+    return true;
+}
+
+/**
+ * Resumes from the checkpoint if shouldResume(). Otherwise a new tree is
+ * built and progress is left at the start.
+ */
+StreamingEMTree_t* streamingEMTreeResume(StreamingEMTree_t::Progress* progress) {
+    progress->job = jobFingerprint();
+    if (!shouldResume()) {
+        return streamingEMTreeInit();
+    }
+    boost::timer::auto_cpu_timer load("loading checkpoint: %w seconds\n");
+    StreamingEMTree_t* emtree = StreamingEMTree_t::load(
+            options.checkpoint, progress);
+    configure(emtree);
+    cout << "resuming from " << options.checkpoint
+            << " at iteration " << progress->iteration
+            << " batch " << progress->batch << endl;
+    return emtree;
+}
+
+void checkpoint(StreamingEMTree_t* emtree, const StreamingEMTree_t::Progress& progress) {
+    boost::timer::auto_cpu_timer save("saving checkpoint: %w seconds\n");
+    emtree->save(options.checkpoint, progress);
+}
+
+/**
+ * Removes the checkpoint once a run has completed, so it is not resumed.
+ */
+void removeCheckpoint() {
+    std::remove(options.checkpoint.c_str());
+}
 
 
 void report(StreamingEMTree_t* emtree) {
@@ -63,12 +140,14 @@ void report(StreamingEMTree_t* emtree) {
     cout << "RMSE = " << emtree->getRMSE() << endl;
 }
 
-void insertWriteClusters(StreamingEMTree_t* emtree) {
-    // open files
-    SVectorStream<SVector<bool>> vs(wikiDocidFile, wikiSignatureFile, wikiSignatureLength);
-
+/**
+ * Writes the cluster of every vector in vs, then prunes the tree and writes
+ * the cluster statistics.
+ */
+template <typename STREAM>
+void insertWriteClusters(StreamingEMTree_t* emtree, STREAM& vs) {
     // setup output streams for all levels in the tree
-    const string prefix = "wikipedia_clusters";
+    const string prefix = options.outputPrefix;
 
     // insert and write cluster assignments
     {
@@ -91,9 +170,17 @@ void insertWriteClusters(StreamingEMTree_t* emtree) {
     }
 }
 
+void insertWriteClusters(StreamingEMTree_t* emtree) {
+    // open files
+    SVectorStream<SVector<bool>> vs(options.docids, options.signatures, options.signatureLength);
+    vs.setSlabs(true);
+    insertWriteClusters(emtree, vs);
+}
+
 void streamingEMTreeInsertPruneReport(StreamingEMTree_t* emtree) {
     // open files
-    SVectorStream<SVector<bool>> vs(wikiDocidFile, wikiSignatureFile, wikiSignatureLength);
+    SVectorStream<SVector<bool>> vs(options.docids, options.signatures, options.signatureLength);
+    vs.setSlabs(true);
 
     // insert from stream
     boost::timer::auto_cpu_timer insert("inserting into streaming EM-tree: %w seconds\n");
@@ -113,19 +200,12 @@ void streamingEMTreeInsertPruneReport(StreamingEMTree_t* emtree) {
 }
 
 void streamingEMTree() {
-    // initialize TBB
-    const bool parallel = true;
-    if (parallel) {
-        tbb::task_scheduler_init init_parallel;
-    } else {
-        tbb::task_scheduler_init init_serial(1);
-    }
-
     // streaming EMTree
-    const int maxIters = 10;
-    StreamingEMTree_t* emtree = streamingEMTreeInit();
+    const int maxIters = options.iterations;
+    StreamingEMTree_t::Progress progress;
+    StreamingEMTree_t* emtree = streamingEMTreeResume(&progress);
     cout << endl << "Streaming EM-tree:" << endl;
-    for (int i = 0; i < maxIters - 1; i++) {
+    for (int i = progress.iteration; i < maxIters - 1; i++) {
         cout << "ITERATION " << i << endl;
         streamingEMTreeInsertPruneReport(emtree);
         {
@@ -133,25 +213,32 @@ void streamingEMTree() {
             emtree->update();
             emtree->clearAccumulators();
         }
+        progress.iteration = i + 1;
+        checkpoint(emtree, progress);
         cout << "-----" << endl << endl;
     }
 
     // last iteration writes cluster assignments and does not update accumulators
     insertWriteClusters(emtree);
+    removeCheckpoint();
 }
 
-void streamingMiniBatchEMTreeInsertUpdateReport(StreamingEMTree_t* emtree) {
+void streamingMiniBatchEMTreeInsertUpdateReport(StreamingEMTree_t* emtree,
+        StreamingEMTree_t::Progress& progress) {
     // open files
-    SVectorStream<SVector<bool>> vs(wikiDocidFile, wikiSignatureFile, wikiSignatureLength);
+    SVectorStream<SVector<bool>> vs(options.docids, options.signatures, options.signatureLength);
+    vs.setSlabs(true);
+
+    // skip batches completed before the checkpoint
+    size_t batchCount = progress.batch;
+    size_t totalRead = skipVectors(vs, progress.vectorsRead);
 
     // insert from stream
-    size_t batchCount = 0;
-    const size_t batchSize = 100000;
+    const size_t batchSize = options.batchSize;
     std::cout << "INITIAL STATE" << std::endl;
     report(emtree);
     std::cout << "------------" << std::endl;
     std::cout << "batch size = " << batchSize << " signatures" << std::endl;
-    size_t totalRead = 0;
     for (;;) {
         std::cout << "BATCH " << batchCount << std::endl;
 
@@ -181,33 +268,34 @@ void streamingMiniBatchEMTreeInsertUpdateReport(StreamingEMTree_t* emtree) {
         update.report();
 
         batchCount++;
+        progress.batch = batchCount;
+        progress.vectorsRead = totalRead;
+        checkpoint(emtree, progress);
         std::cout << "------------" << std::endl;
     }
 
     // clear accumulators for next iteration
     emtree->clearAccumulators();
+    progress.iteration++;
+    progress.batch = 0;
+    progress.vectorsRead = 0;
+    checkpoint(emtree, progress);
 }
 
 void streamingMiniBatchEMTree() {
-    // initialize TBB
-    const bool parallel = true;
-    if (parallel) {
-        tbb::task_scheduler_init init_parallel;
-    } else {
-        tbb::task_scheduler_init init_serial(1);
-    }
-
     // streaming EMTree
-    StreamingEMTree_t* emtree = streamingEMTreeInit();
+    StreamingEMTree_t::Progress progress;
+    StreamingEMTree_t* emtree = streamingEMTreeResume(&progress);
     cout << endl << "Streaming EM-tree:" << endl;
-    const int maxIters = 2;
-    for (int i = 0; i < maxIters - 1; i++) {
+    const int maxIters = options.iterations;
+    for (int i = progress.iteration; i < maxIters - 1; i++) {
         cout << "ITERATION " << i << endl;
-        streamingMiniBatchEMTreeInsertUpdateReport(emtree);
+        streamingMiniBatchEMTreeInsertUpdateReport(emtree, progress);
     }
 
     // last iteration writes cluster assignments and does not update accumulators
     insertWriteClusters(emtree);
+    removeCheckpoint();
 }
 #endif	/* STREAMINGEMTREEEXPERIMENTS_H */
 
@@ -0,0 +1,82 @@
+/**
+ * This file contains the operations used by StreamingEMTree on ACCUMULATORs.
+ * An ACCUMULATOR sums objects of type T so that a prototype can be calculated
+ * in a streaming setting.
+ *
+ * ACCUMULATORs must support being constructed with the number of dimensions,
+ *      auto a = ACCUMULATOR(dimensions);
+ * and the operations
+ *      a.setAll(0);
+ *      a.size();
+ *      a[i] += 1;
+ *
+ * accumulate(a, object) adds an object to an accumulator. The general version
+ * adds one dimension at a time. Overloads for specific accumulators can add
+ * whole blocks at once.
+ *
+ * mergeAccumulator(total, a) adds the counts in accumulator a to total.
+ *
+ * saveAccumulator(out, a) writes the counts as size() uint32_t values, and
+ * loadAccumulator(data, a) sets a from counts written that way.
+ *
+ * For example,
+ *      SVector<uint32_t> a(4096);
+ *      a.setAll(0);
+ *      accumulate(a, *vector);
+ */
+
+#ifndef ACCUMULATOR_H
+#define	ACCUMULATOR_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+#include "BitSlicedAccumulator.h"
+
+namespace lmw {
+
+template <typename ACCUMULATOR, typename T>
+inline void accumulate(ACCUMULATOR& accumulator, const T& object) {
+    for (size_t i = 0; i < accumulator.size(); i++) {
+        accumulator[i] += object[i];
+    }
+}
+
+inline void accumulate(BitSlicedAccumulator& accumulator,
+        const SVector<bool>& object) {
+    accumulator.add(object);
+}
+
+template <typename ACCUMULATOR>
+inline void mergeAccumulator(ACCUMULATOR& total, ACCUMULATOR& accumulator) {
+    for (size_t i = 0; i < total.size(); i++) {
+        total[i] += accumulator[i];
+    }
+}
+
+inline void mergeAccumulator(BitSlicedAccumulator& total,
+        BitSlicedAccumulator& accumulator) {
+    total.add(accumulator);
+}
+
+template <typename ACCUMULATOR>
+void saveAccumulator(std::ostream& out, const ACCUMULATOR& accumulator) {
+    vector<uint32_t> counts(accumulator.size());
+    for (size_t i = 0; i < counts.size(); i++) {
+        counts[i] = accumulator[i];
+    }
+    out.write(reinterpret_cast<const char*>(counts.data()),
+            counts.size() * sizeof(uint32_t));
+}
+
+template <typename ACCUMULATOR>
+void loadAccumulator(const char* data, ACCUMULATOR& accumulator) {
+    accumulator.setAll(0);
+    const uint32_t* counts = reinterpret_cast<const uint32_t*>(data);
+    for (size_t i = 0; i < accumulator.size(); i++) {
+        accumulator[i] += counts[i];
+    }
+}
+
+} // namespace lmw
+
+#endif	/* ACCUMULATOR_H */
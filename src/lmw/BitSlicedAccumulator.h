@@ -0,0 +1,136 @@
+#ifndef BITSLICEDACCUMULATOR_H
+#define	BITSLICEDACCUMULATOR_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+
+namespace lmw {
+
+/**
+ * A BitSlicedAccumulator counts how many times each bit has been set over
+ * many bit vectors. It can be used as the ACCUMULATOR for bit vectors in
+ * StreamingEMTree.
+ *
+ * Rather than incrementing one counter per dimension, whole 64-bit blocks
+ * are absorbed into a vertical (bit-sliced) counter. Plane p holds bit p of
+ * the count for each of the 64 dimensions in a block, so adding a block is a
+ * ripple carry through the planes using a handful of AND and XOR operations.
+ * The carry usually dies out after one or two planes. Once enough vectors
+ * have been added that a plane counter could overflow, the planes are
+ * spilled into ordinary 32-bit counters.
+ *
+ * For example,
+ *      BitSlicedAccumulator accumulator(4096);
+ *      accumulator.setAll(0);
+ *      accumulator.add(*vector);
+ *      uint32_t count = accumulator[42];
+ */
+class BitSlicedAccumulator {
+public:
+    explicit BitSlicedAccumulator(const size_t length) : _length(length),
+            _numBlocks((length + W_SIZE - 1) >> BITS_WS),
+            _planes(_numBlocks * numPlanes, 0),
+            _counts(_numBlocks << BITS_WS, 0), _pending(0) { }
+
+    size_t size() const {
+        return _length;
+    }
+
+    void setAll(const uint32_t value) {
+        std::fill(_planes.begin(), _planes.end(), 0);
+        std::fill(_counts.begin(), _counts.end(), value);
+        _pending = 0;
+    }
+
+    /**
+     * Adds a bit vector of the same length.
+     */
+    void add(const SVector<bool>& vector) {
+        const block_type* data = vector.getData();
+        for (size_t b = 0; b < _numBlocks; ++b) {
+            block_type* planes = &_planes[b * numPlanes];
+            block_type carry = data[b];
+            for (size_t p = 0; carry && p < numPlanes; ++p) {
+                block_type overflow = planes[p] & carry;
+                planes[p] ^= carry;
+                carry = overflow;
+            }
+        }
+        if (++_pending == maxPending) {
+            flush();
+        }
+    }
+
+    /**
+     * Adds the counts from another accumulator of the same length.
+     */
+    void add(const BitSlicedAccumulator& other) {
+        flush();
+        for (size_t i = 0; i < _length; ++i) {
+            _counts[i] += other[i];
+        }
+    }
+
+    /**
+     * Spills any counts held in the bit planes into the 32-bit counters.
+     */
+    void flush() {
+        if (_pending == 0) {
+            return;
+        }
+        for (size_t b = 0; b < _numBlocks; ++b) {
+            block_type* planes = &_planes[b * numPlanes];
+            uint32_t* counts = &_counts[b << BITS_WS];
+            for (size_t p = 0; p < numPlanes; ++p) {
+                block_type plane = planes[p];
+                while (plane) {
+                    counts[__builtin_ctzll(plane)] += uint32_t(1) << p;
+                    plane &= plane - 1;
+                }
+                planes[p] = 0;
+            }
+        }
+        _pending = 0;
+    }
+
+    /**
+     * Direct access to a counter flushes the bit planes first so the
+     * reference can be used to modify the count.
+     */
+    uint32_t& operator[](const size_t i) {
+        flush();
+        return _counts[i];
+    }
+
+    uint32_t operator[](const size_t i) const {
+        uint32_t count = _counts[i];
+        if (_pending && i < (_numBlocks << BITS_WS)) {
+            const block_type* planes = &_planes[(i >> BITS_WS) * numPlanes];
+            for (size_t p = 0; p < numPlanes; ++p) {
+                count += uint32_t((planes[p] >> (i & MASK)) & 1) << p;
+            }
+        }
+        return count;
+    }
+
+private:
+    // 8 planes count to 255 before they must be spilled.
+    static const size_t numPlanes = 8;
+    static const uint32_t maxPending = (1 << numPlanes) - 1;
+
+    size_t _length;
+    size_t _numBlocks;
+
+    // numPlanes planes for each block, stored block by block so that
+    // adding a block touches one cache line.
+    vector<block_type> _planes;
+
+    vector<uint32_t> _counts;
+
+    // vectors added since the planes were last flushed
+    uint32_t _pending;
+};
+
+} // namespace lmw
+
+#endif	/* BITSLICEDACCUMULATOR_H */
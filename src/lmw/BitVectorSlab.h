@@ -0,0 +1,137 @@
+#ifndef BITVECTORSLAB_H
+#define	BITVECTORSLAB_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace lmw {
+
+/**
+ * A BitVectorSlab stores a chunk of bit vectors in one allocation aligned to
+ * a cache line. The slab starts with its header, followed by the SVector<bool>
+ * views and then the bits of every vector, each padded to a whole number of
+ * cache lines. The IDs of the chunk are interned into one string, so a chunk
+ * of n vectors needs a few allocations rather than 2 or 3 per vector.
+ *
+ * A stream fills the bits with getBits() and adds IDs in order with addID(),
+ * then release() constructs the views and appends them to a chunk. The views
+ * belong to the slab, which is destroyed with all of them by destroy().
+ *
+ * For example,
+ *      BitVectorSlab* slab = BitVectorSlab::create(n, 4096);
+ *      for (size_t i = 0; i < n; ++i) {
+ *          read(slab->getBits(i));
+ *          slab->addID(ids[i]);
+ *      }
+ *      slab->release(&data);
+ *      process(data);
+ *      BitVectorSlab::destroy(&data);
+ */
+class BitVectorSlab {
+public:
+    /**
+     * Allocates a slab for up to capacity vectors of length bits.
+     */
+    static BitVectorSlab* create(const size_t capacity, const size_t length) {
+        const size_t viewBytes = roundUp(capacity * sizeof(SVector<bool>));
+        const size_t stride = roundUp(length / 8);
+        void* memory = NULL;
+        if (posix_memalign(&memory, cacheLineSize,
+                headerBytes() + viewBytes + capacity * stride) != 0) {
+            throw std::bad_alloc();
+        }
+        return new (memory) BitVectorSlab(capacity, length, viewBytes, stride);
+    }
+
+    /**
+     * Destroys the slab holding the vectors in data, which must contain
+     * exactly the vectors from one call to release().
+     */
+    static void destroy(vector<SVector<bool>*>* data) {
+        if (data->empty()) {
+            return;
+        }
+        BitVectorSlab* slab = reinterpret_cast<BitVectorSlab*>(
+                reinterpret_cast<char*>(data->front()) - headerBytes());
+        for (SVector<bool>* view : *data) {
+            view->~SVector<bool>();
+        }
+        slab->destroy();
+    }
+
+    /**
+     * Destroys a slab that has not been released or was released empty.
+     */
+    void destroy() {
+        this->~BitVectorSlab();
+        free(this);
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
+    /**
+     * The bits of vector i, aligned to a cache line.
+     */
+    block_type* getBits(const size_t i) {
+        return reinterpret_cast<block_type*>(_bits + i * _stride);
+    }
+
+    /**
+     * Sets the ID of the next vector.
+     */
+    void addID(const string& id) {
+        _ids.append(id);
+        _idEnds.push_back(_ids.size());
+    }
+
+    /**
+     * Constructs views of the vectors that have an ID and appends them to
+     * data. No more IDs may be added afterwards.
+     */
+    void release(vector<SVector<bool>*>* data) {
+        SVector<bool>* views = reinterpret_cast<SVector<bool>*>(
+                reinterpret_cast<char*>(this) + headerBytes());
+        size_t begin = 0;
+        for (size_t i = 0; i < _idEnds.size(); ++i) {
+            data->push_back(new (&views[i]) SVector<bool>(getBits(i), _length,
+                    _ids.data() + begin, _idEnds[i] - begin));
+            begin = _idEnds[i];
+        }
+    }
+
+    static const size_t cacheLineSize = 64;
+
+private:
+    BitVectorSlab(const size_t capacity, const size_t length,
+            const size_t viewBytes, const size_t stride) :
+        _capacity(capacity), _length(length), _stride(stride),
+        _bits(reinterpret_cast<char*>(this) + headerBytes() + viewBytes) {
+        _idEnds.reserve(capacity);
+    }
+
+    static size_t roundUp(const size_t bytes) {
+        return (bytes + cacheLineSize - 1) / cacheLineSize * cacheLineSize;
+    }
+
+    static size_t headerBytes() {
+        return roundUp(sizeof(BitVectorSlab));
+    }
+
+    const size_t _capacity;
+    const size_t _length; // the length of each vector in bits
+    const size_t _stride; // bytes from one vector to the next
+    char* const _bits;
+
+    // IDs of all vectors, where the ID of vector i ends at _idEnds[i]
+    string _ids;
+    vector<size_t> _idEnds;
+};
+
+} // namespace lmw
+
+#endif	/* BITVECTORSLAB_H */
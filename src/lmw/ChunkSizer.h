@@ -0,0 +1,128 @@
+#ifndef CHUNKSIZER_H
+#define	CHUNKSIZER_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+#include "tbb/spin_mutex.h"
+#include "tbb/task_scheduler_init.h"
+
+namespace lmw {
+
+/**
+ * ChunkSizer decides how many vectors a stream processing pipeline reads at
+ * once and how many of these chunks can be in memory at the same time.
+ *
+ * With a fixed size every chunk has readSize vectors and the pipeline has
+ * maxTokens chunks in flight, so up to readSize * maxTokens vectors are in
+ * memory.
+ *
+ * In adaptive mode the pipeline only has tokensPerThread chunks in flight
+ * for each thread, which is enough to keep every thread busy while the
+ * input filter reads. The size of each chunk follows the measured time it
+ * took to process the previous chunks so that a chunk takes about
+ * targetSeconds, which amortizes the per chunk overhead without making
+ * chunks so large that threads wait for stragglers. If memoryBudget is not
+ * 0, chunks are made small enough that all chunks in flight fit in
+ * memoryBudget bytes. The first chunks are small while the time and size of
+ * a vector are measured, and chunks at most double in size from one chunk to
+ * the next.
+ *
+ * The memory budget only covers vectors read from the stream, not the tree.
+ *
+ * readSize() and record() are thread safe.
+ */
+class ChunkSizer {
+public:
+    /**
+     * Chunks of exactly readSize vectors with maxTokens in flight.
+     */
+    ChunkSizer(const size_t readSize, const size_t maxTokens) :
+        _adaptive(false), _tokens(maxTokens), _memoryBudget(0),
+        _targetSeconds(0), _readSize(readSize) {
+    }
+
+    /**
+     * Adaptive chunks with at most maxTokens in flight for a pipeline that
+     * runs on threads threads, or on TBB's default number if it is 0.
+     */
+    ChunkSizer(const size_t maxTokens, const size_t threads,
+            const size_t memoryBudget, const double targetSeconds) :
+        _adaptive(true),
+        _tokens(std::max<size_t>(1, std::min(maxTokens, tokensPerThread
+            * (threads > 0 ? threads : size_t(tbb::task_scheduler_init::default_num_threads()))))),
+        _memoryBudget(memoryBudget), _targetSeconds(targetSeconds),
+        _readSize(initialReadSize) {
+    }
+
+    /**
+     * The number of chunks the pipeline may have in flight.
+     */
+    size_t tokens() const {
+        return _tokens;
+    }
+
+    /**
+     * How many vectors to read for the next chunk.
+     */
+    size_t readSize() const {
+        return _readSize;
+    }
+
+    /**
+     * Records that processing chunk took seconds and resizes the following
+     * chunks. It does nothing unless adaptive.
+     */
+    void record(const vector<SVector<bool>*>& chunk, const double seconds) {
+        if (!_adaptive || chunk.empty()) {
+            return;
+        }
+        const double bytesPerVector = sizeof(SVector<bool>*) + sizeof(SVector<bool>)
+                + chunk[0]->getNumBlocks() * sizeof(block_type);
+        const double secondsPerVector = seconds / chunk.size();
+
+        tbb::spin_mutex::scoped_lock lock(_mutex);
+        _bytesPerVector = std::max(_bytesPerVector, bytesPerVector);
+        if (_secondsPerVector == 0) {
+            _secondsPerVector = secondsPerVector;
+        } else {
+            _secondsPerVector += smoothing * (secondsPerVector - _secondsPerVector);
+        }
+        double next = 2.0 * _readSize;
+        if (_secondsPerVector > 0) {
+            next = std::min(next, _targetSeconds / _secondsPerVector);
+        }
+        if (_memoryBudget > 0) {
+            next = std::min(next, _memoryBudget / (_tokens * _bytesPerVector));
+        }
+        _readSize = std::max<size_t>(1, size_t(next));
+    }
+
+    // chunks in flight per thread in adaptive mode
+    static const size_t tokensPerThread = 4;
+
+    // vectors in the first adaptive chunks
+    static const size_t initialReadSize = 64;
+
+    // weight of the latest chunk in the moving average time per vector
+    static constexpr double smoothing = 0.25;
+
+private:
+    const bool _adaptive;
+    const size_t _tokens;
+    const size_t _memoryBudget;
+    const double _targetSeconds;
+
+    atomic<size_t> _readSize;
+
+    // moving average of the time to process a vector
+    double _secondsPerVector = 0;
+
+    // the largest size of a vector seen, including the chunk's pointer to it
+    double _bytesPerVector = 0;
+
+    tbb::spin_mutex _mutex;
+};
+
+} // namespace lmw
+
+#endif	/* CHUNKSIZER_H */
@@ -57,6 +57,22 @@ struct euclideanDistanceSq {
     }    
 };
 
+/**
+ * SVector<float> uses the kernels in FloatKernels.h over the zeroed padding,
+ * so the kernel has no tail to handle.
+ */
+template <>
+struct euclideanDistanceSq<SVector<float>> {
+    double operator()(const SVector<float> *t1, const SVector<float> *t2) const {
+        return FloatKernels::best().squaredDistance(t1->getData(), t2->getData(),
+                t1->paddedSize());
+    }
+
+    double squared(const SVector<float> *t1, const SVector<float> *t2) const {
+        return operator()(t1, t2);
+    }
+};
+
 template <typename T>
 struct euclideanDistance {
     double operator()(const T *t1, const T *t2) const {
@@ -70,6 +86,45 @@ struct euclideanDistance {
     euclideanDistanceSq<T> _squared;
 };
 
+/**
+ * 1 - the cosine of the angle between two vectors. It is 1 if either vector
+ * is 0.
+ */
+template <typename T>
+struct cosineDistance {
+    double operator()(const T *t1, const T *t2) const {
+        double dot = 0, norm1 = 0, norm2 = 0;
+        typename T::const_iterator it1 = t1->begin(), it2 = t2->begin();
+        for (; it1 != t1->end() && it2 != t2->end(); ++it1, ++it2) {
+            dot += double(*it1) * *it2;
+            norm1 += double(*it1) * *it1;
+            norm2 += double(*it2) * *it2;
+        }
+        if (norm1 == 0 || norm2 == 0) {
+            return 1;
+        }
+        return 1 - dot / sqrt(norm1 * norm2);
+    }
+
+    double squared(const T *t1, const T *t2) const {
+        double distance = operator()(t1, t2);
+        return distance * distance;
+    }
+};
+
+template <>
+struct cosineDistance<SVector<float>> {
+    double operator()(const SVector<float> *t1, const SVector<float> *t2) const {
+        return 1 - FloatKernels::best().cosine(t1->getData(), t2->getData(),
+                t1->paddedSize());
+    }
+
+    double squared(const SVector<float> *t1, const SVector<float> *t2) const {
+        double distance = operator()(t1, t2);
+        return distance * distance;
+    }
+};
+
 } // namespace lmw
 
 #endif	/* DISTANCE_H */
@@ -4,6 +4,8 @@
 #include "StdIncludes.h"
 
 #include "Node.h"
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
 
 namespace lmw {
 
@@ -15,6 +17,9 @@ public:
     }
     
     EMTree(Node<T>* root) : _m(-1), _root(root) {
+        _root->updateCountsRecursively();
+        _root->setSumSquaredError(-1);
+        packKeys(_root);
     }    
     
     ~EMTree() {
@@ -22,11 +27,11 @@ public:
     }
 
     int getClusterCount() {
-        return clusterCount(_root);
+        return _root->getClusterCount();
     }
 
     uint64_t getObjCount() {
-        return objCount(_root);
+        return _root->getObjCount();
     }
 
     int getLevelCount() {
@@ -62,6 +67,9 @@ public:
             clusterer.setMaxIters(0);
         }
         seed(_root, splits, clusterer);
+        _root->updateCountsRecursively();
+        _root->setSumSquaredError(-1);
+        packKeys(_root);
     }
     
     void seed(Node<T>* current, deque<int> splits, CLUSTERER& clusterer) {
@@ -128,9 +136,9 @@ public:
     void replace(vector<T*> &data) {
         removeData(_root, removed);
         removed.clear();
-        for (T* vector : data) {
-            pushDownNoUpdate(_root, vector);
-        }
+        pushDownNoUpdate(data);
+        _root->updateCountsRecursively();
+        _root->setSumSquaredError(-1);
     }
 
     
@@ -138,9 +146,9 @@ public:
 
         removeData(_root, removed);
 
-        for (int i = 0; i < removed.size(); i++) {
-            pushDownNoUpdate(_root, removed[i]);
-        }
+        pushDownNoUpdate(removed);
+        _root->updateCountsRecursively();
+        _root->setSumSquaredError(-1);
 
         removed.clear();
     }
@@ -151,6 +159,7 @@ public:
             for (int i = 0; i < removed.size(); i++) {
                 pushDownNoUpdateInternal(_root, removed[i], removedChildren[i], depth);
             }
+            _root->updateCountsRecursively();
             prune();
             removed.clear();
             removedChildren.clear();
@@ -158,16 +167,26 @@ public:
     }    
 
     int prune() {
+        _root->setSumSquaredError(-1);
         return prune(_root);
     }
 
     void rebuildInternal() {
-        // rebuild starting with above leaf level (bottom up)
-        // we are rebuilding means in internal nodes only, this is why we start 
-        // with the above leaf level
-        for (int depth = getLevelCount() - 1; depth >= 1; --depth) {
-            rebuildInternal(_root, depth);
-        }
+        // rebuild means in internal nodes bottom up, counting the objects in
+        // every subtree on the way
+        rebuildInternal(_root);
+        _root->setSumSquaredError(-1);
+        packKeys(_root);
+    }
+
+    /**
+     * Packed keys store the keys of each internal node in one contiguous
+     * KeyMatrix for faster nearest neighbor search. They are enabled by
+     * default.
+     */
+    void setPackedKeys(const bool packedKeys) {
+        _packedKeys = packedKeys;
+        packKeys(_root);
     }
 
     double getRMSE() {
@@ -178,9 +197,11 @@ public:
 private:
 
     double RMSE() {
-        double SSE = sumSquaredError(NULL, _root);
+        if (_root->getSumSquaredError() < 0) {
+            _root->setSumSquaredError(sumSquaredError(NULL, _root));
+        }
         uint64_t size = getObjCount();
-        return sqrt(SSE / size);
+        return sqrt(_root->getSumSquaredError() / size);
     }
 
     double sumSquaredError(T* parentKey, Node<T> *child) {
@@ -199,37 +220,6 @@ private:
         return distance;
     }
 
-    uint64_t objCount(Node<T>* current) {
-        if (current->isLeaf()) {
-            return current->size();
-        } else {
-            uint64_t localCount = 0;
-            vector<Node<T>*>& children = current->getChildren();
-            for (Node<T> *child : children) {
-                localCount += objCount(child);
-
-            }
-            return localCount;
-        }
-    }
-
-    int clusterCount(Node<T>* current) {
-        if (current->isLeaf()) {
-            if (current->isEmpty()) {
-                return 0;
-            } else {
-                return 1;
-            }
-        } else {
-            int localCount = 0;
-            vector<Node<T>*>& children = current->getChildren();
-            for (Node<T> *child : children) {
-                localCount += clusterCount(child);
-            }
-            return localCount;
-        }
-    }
-
     int levelCount(Node<T>* current) {
         if (current->isLeaf()) {
             return 1;
@@ -285,45 +275,125 @@ private:
                 }
             }
             n->finalizeRemovals();
+            n->updateCounts();
             return pruned;
         }
     }
 
-    void rebuildInternal(Node<T> *n, int depth) {
+    /**
+     * Rebuilds the subtrees of the children of n in parallel and then updates
+     * the key of each child from the child's own keys. A key only depends on
+     * keys below it, so every node is visited once, in post-order. The number
+     * of objects in each subtree is cached in its node to weight the
+     * prototypes above it.
+     */
+    void rebuildInternal(Node<T> *n) {
         if (n->isLeaf()) {
+            n->updateCounts();
             return;
         }
         vector<Node<T>*> &children = n->getChildren();
-        if (depth == 1) {
-            vector<T*> &keys = n->getKeys();
-            for (int i = 0; i < children.size(); ++i) {
-                Node<T>* child = children[i];
-                T* key = keys[i];
-                updatePrototype(child, key);
+        vector<T*> &keys = n->getKeys();
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, children.size()),
+                [&](const tbb::blocked_range<size_t>& r) {
+            vector<int> weights;
+            for (size_t i = r.begin(); i != r.end(); ++i) {
+                rebuildInternal(children[i]);
+                updatePrototype(children[i], keys[i], weights);
             }
-        } else {
-            for (int i = 0; i < children.size(); ++i) {
-                rebuildInternal(children[i], depth - 1);
-            }
-        }
+        });
+        n->updateCounts();
     }
 
     Node<T>* nearestChild(Node<T>* n, T* vec) {
         vector<T*>& keys = n->getKeys();
         vector<Node<T>*>& children = n->getChildren();
-        auto nearest = _optimizer.nearest(vec, keys);
+        auto nearest = _optimizer.nearest(vec, keys, n->getKeyMatrix());
         return children[nearest.index];
     }
 
-    void pushDownNoUpdate(Node<T> *n, T *vec) {
+    // Leaf keys are data vectors that change every iteration so only
+    // internal nodes are packed.
+    void packKeys(Node<T>* n) {
         if (n->isLeaf()) {
-            n->add(vec); // Finished
-        } else { // It is an internal node.
-            // recurse via nearest neighbor cluster
-            pushDownNoUpdate(nearestChild(n, vec), vec);
+            return;
+        }
+        n->setKeyMatrix(_packedKeys ? KeyPacker<T>::pack(n->getKeys()) : NULL);
+        for (Node<T>* child : n->getChildren()) {
+            packKeys(child);
         }
     }
-    
+
+    /**
+     * Pushes every vector in data down to its nearest leaf. The nearest
+     * leaves are found in parallel, then the vectors are counting sorted by
+     * leaf and each leaf is filled by one task. Every leaf receives its
+     * vectors in the same order as pushing them down one at a time.
+     */
+    void pushDownNoUpdate(vector<T*> &data) {
+        if (_root->isLeaf()) {
+            for (T* object : data) {
+                _root->add(object);
+            }
+            return;
+        }
+        vector<Node<T>*> leaves;
+        collectLeaves(_root, leaves);
+        std::unordered_map<const Node<T>*, size_t> leafIndex;
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            leafIndex[leaves[i]] = i;
+        }
+
+        // find the nearest leaf of every vector
+        vector<size_t> leafOf(data.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 256),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        leafOf[i] = leafIndex.find(nearestLeaf(_root, data[i]))->second;
+                    }
+                }
+        );
+
+        // counting sort by leaf, keeping the order of data within a leaf
+        vector<size_t> offsets(leaves.size() + 1, 0);
+        for (size_t leaf : leafOf) {
+            ++offsets[leaf + 1];
+        }
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+        vector<size_t> next(offsets.begin(), offsets.end() - 1);
+        vector<T*> sorted(data.size());
+        for (size_t i = 0; i < data.size(); ++i) {
+            sorted[next[leafOf[i]]++] = data[i];
+        }
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, leaves.size()),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t leaf = r.begin(); leaf != r.end(); ++leaf) {
+                        for (size_t i = offsets[leaf]; i < offsets[leaf + 1]; ++i) {
+                            leaves[leaf]->add(sorted[i]);
+                        }
+                    }
+                }
+        );
+    }
+
+    Node<T>* nearestLeaf(Node<T>* n, T* vec) {
+        while (!n->isLeaf()) {
+            n = nearestChild(n, vec);
+        }
+        return n;
+    }
+
+    void collectLeaves(Node<T>* n, vector<Node<T>*>& leaves) {
+        if (n->isLeaf()) {
+            leaves.push_back(n);
+        } else {
+            for (Node<T>* child : n->getChildren()) {
+                collectLeaves(child, leaves);
+            }
+        }
+    }
+
     void pushDownNoUpdateInternal(Node<T> *n, T* key, Node<T>* child, int depth) {
         if (depth == 1) {
             n->add(key, child); // Finished
@@ -333,13 +403,14 @@ private:
         }
     }    
 
-    // Update the protype parentKey
-    void updatePrototype(Node<T> *child, T* parentKey) {
+    // Update the protype parentKey, weighting by the cached object counts
+    // of the grandchildren
+    void updatePrototype(Node<T> *child, T* parentKey, vector<int>& weights) {
         weights.clear();
         if (!child->isLeaf()) {
             vector<Node<T>*>& children = child->getChildren();
             for (size_t i = 0; i < children.size(); i++) {
-                weights.push_back(objCount(children[i]));
+                weights.push_back(children[i]->getObjCount());
             }
         }
         _optimizer.updatePrototype(parentKey, child->getKeys(), weights);
@@ -375,11 +446,11 @@ private:
 
     OPTIMIZER _optimizer;
 
+    // Search keys packed into a KeyMatrix in each internal node.
+    bool _packedKeys = true;
+
     vector<T*> removed;
     vector<Node<T>*> removedChildren;
-
-    // Weights for prototype function (we don't have to use these)
-    vector<int> weights;    
 };
 
 } // namespace lmw
@@ -0,0 +1,392 @@
+/**
+ * This file contains the kernels for dense float vectors used by
+ * SVector<float>, euclideanDistanceSq, cosineDistance and meanPrototype.
+ *
+ * As with HammingKernels.h there is one kernel per instruction set and the
+ * fastest kernel supported by the CPU is selected once at startup via CPUID.
+ *
+ * The kernels are
+ *      scalar  - portable loops that accumulate in double
+ *      avx2    - 8 float lanes with FMA and 4 independent accumulators
+ *      avx512  - 16 float lanes with FMA and a masked tail
+ *
+ * The SIMD kernels accumulate in float lanes, so sums over long vectors can
+ * differ from the scalar kernel in the last few bits.
+ *
+ * Each kernel provides
+ *      squaredDistance(a, b, n)    - sum of (a[i] - b[i])^2
+ *      dot(a, b, n)                - sum of a[i] * b[i]
+ *      cosine(a, b, n)             - dot(a, b) / (|a| |b|) in one pass, or 0
+ *                                    if either vector is 0
+ *      addMult(y, x, coef, n)      - y[i] += coef * x[i]
+ *      scale(y, coef, n)           - y[i] *= coef
+ *
+ * For example,
+ *      const FloatKernel& kernel = FloatKernels::best();
+ *      double distance = kernel.squaredDistance(a, b, n);
+ *
+ * The selection can be overridden by setting the LMW_FLOAT_KERNEL
+ * environment variable to the name of a kernel.
+ */
+
+#ifndef FLOAT_KERNELS_H
+#define	FLOAT_KERNELS_H
+
+#include "StdIncludes.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LMW_FLOAT_X86 1
+#include <immintrin.h>
+#endif
+
+namespace lmw {
+
+typedef double (*FloatReduceFunc)(const float* a, const float* b, const size_t n);
+typedef void (*FloatAddMultFunc)(float* y, const float* x, const float coef,
+        const size_t n);
+typedef void (*FloatScaleFunc)(float* y, const float coef, const size_t n);
+
+struct FloatKernel {
+    const char* name;
+    FloatReduceFunc squaredDistance;
+    FloatReduceFunc dot;
+    FloatReduceFunc cosine;
+    FloatAddMultFunc addMult;
+    FloatScaleFunc scale;
+    bool supported;
+};
+
+class FloatKernels {
+public:
+    /**
+     * Returns all kernels compiled into this binary. Kernels that are not
+     * supported by the current CPU have supported == false and must not be
+     * called.
+     */
+    static const vector<FloatKernel>& all() {
+        static const vector<FloatKernel> kernels = createKernels();
+        return kernels;
+    }
+
+    /**
+     * Returns the fastest kernel supported by this CPU. It is selected once
+     * on first use.
+     */
+    static const FloatKernel& best() {
+        static const FloatKernel& kernel = selectKernel();
+        return kernel;
+    }
+
+private:
+    static double scalarSquaredDistance(const float* a, const float* b,
+            const size_t n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            double d = a[i] - b[i];
+            sum += d * d;
+        }
+        return sum;
+    }
+
+    static double scalarDot(const float* a, const float* b, const size_t n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += double(a[i]) * b[i];
+        }
+        return sum;
+    }
+
+    static double scalarCosine(const float* a, const float* b, const size_t n) {
+        double dot = 0, normA = 0, normB = 0;
+        for (size_t i = 0; i < n; ++i) {
+            dot += double(a[i]) * b[i];
+            normA += double(a[i]) * a[i];
+            normB += double(b[i]) * b[i];
+        }
+        return cosine(dot, normA, normB);
+    }
+
+    static void scalarAddMult(float* y, const float* x, const float coef,
+            const size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            y[i] += coef * x[i];
+        }
+    }
+
+    static void scalarScale(float* y, const float coef, const size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            y[i] *= coef;
+        }
+    }
+
+    static double cosine(const double dot, const double normA,
+            const double normB) {
+        if (normA == 0 || normB == 0) {
+            return 0;
+        }
+        return dot / std::sqrt(normA * normB);
+    }
+
+#ifdef LMW_FLOAT_X86
+    /**
+     * 32 floats per iteration in 4 accumulators hide the latency of FMA.
+     * Then 8 floats at a time and a scalar tail.
+     */
+    __attribute__((target("avx2,fma")))
+    static double avx2SquaredDistance(const float* a, const float* b,
+            const size_t n) {
+        __m256 s0 = _mm256_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+            __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16));
+            __m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24));
+            s0 = _mm256_fmadd_ps(d0, d0, s0);
+            s1 = _mm256_fmadd_ps(d1, d1, s1);
+            s2 = _mm256_fmadd_ps(d2, d2, s2);
+            s3 = _mm256_fmadd_ps(d3, d3, s3);
+        }
+        for (; i + 8 <= n; i += 8) {
+            __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+            s0 = _mm256_fmadd_ps(d, d, s0);
+        }
+        double sum = avx2Sum(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+        for (; i < n; ++i) {
+            double d = a[i] - b[i];
+            sum += d * d;
+        }
+        return sum;
+    }
+
+    __attribute__((target("avx2,fma")))
+    static double avx2Dot(const float* a, const float* b, const size_t n) {
+        __m256 s0 = _mm256_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+            s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), s2);
+            s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), s3);
+        }
+        for (; i + 8 <= n; i += 8) {
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+        }
+        double sum = avx2Sum(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+        for (; i < n; ++i) {
+            sum += double(a[i]) * b[i];
+        }
+        return sum;
+    }
+
+    __attribute__((target("avx2,fma")))
+    static double avx2Cosine(const float* a, const float* b, const size_t n) {
+        __m256 dot0 = _mm256_setzero_ps(), dot1 = dot0;
+        __m256 normA0 = dot0, normA1 = dot0, normB0 = dot0, normB1 = dot0;
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m256 a0 = _mm256_loadu_ps(a + i), a1 = _mm256_loadu_ps(a + i + 8);
+            __m256 b0 = _mm256_loadu_ps(b + i), b1 = _mm256_loadu_ps(b + i + 8);
+            dot0 = _mm256_fmadd_ps(a0, b0, dot0);
+            dot1 = _mm256_fmadd_ps(a1, b1, dot1);
+            normA0 = _mm256_fmadd_ps(a0, a0, normA0);
+            normA1 = _mm256_fmadd_ps(a1, a1, normA1);
+            normB0 = _mm256_fmadd_ps(b0, b0, normB0);
+            normB1 = _mm256_fmadd_ps(b1, b1, normB1);
+        }
+        for (; i + 8 <= n; i += 8) {
+            __m256 a0 = _mm256_loadu_ps(a + i), b0 = _mm256_loadu_ps(b + i);
+            dot0 = _mm256_fmadd_ps(a0, b0, dot0);
+            normA0 = _mm256_fmadd_ps(a0, a0, normA0);
+            normB0 = _mm256_fmadd_ps(b0, b0, normB0);
+        }
+        double dot = avx2Sum(_mm256_add_ps(dot0, dot1));
+        double normA = avx2Sum(_mm256_add_ps(normA0, normA1));
+        double normB = avx2Sum(_mm256_add_ps(normB0, normB1));
+        for (; i < n; ++i) {
+            dot += double(a[i]) * b[i];
+            normA += double(a[i]) * a[i];
+            normB += double(b[i]) * b[i];
+        }
+        return cosine(dot, normA, normB);
+    }
+
+    __attribute__((target("avx2,fma")))
+    static void avx2AddMult(float* y, const float* x, const float coef,
+            const size_t n) {
+        const __m256 c = _mm256_set1_ps(coef);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            _mm256_storeu_ps(y + i, _mm256_fmadd_ps(c, _mm256_loadu_ps(x + i),
+                    _mm256_loadu_ps(y + i)));
+        }
+        for (; i < n; ++i) {
+            y[i] += coef * x[i];
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static void avx2Scale(float* y, const float coef, const size_t n) {
+        const __m256 c = _mm256_set1_ps(coef);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            _mm256_storeu_ps(y + i, _mm256_mul_ps(c, _mm256_loadu_ps(y + i)));
+        }
+        for (; i < n; ++i) {
+            y[i] *= coef;
+        }
+    }
+
+    __attribute__((target("avx2"), always_inline))
+    static inline double avx2Sum(const __m256 v) {
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+    }
+
+    /**
+     * Two accumulators of 16 lanes. The tail is handled with masked loads,
+     * which read 0 for lanes beyond n.
+     */
+    __attribute__((target("avx512f")))
+    static double avx512SquaredDistance(const float* a, const float* b,
+            const size_t n) {
+        __m512 s0 = _mm512_setzero_ps(), s1 = s0;
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+            __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+            s0 = _mm512_fmadd_ps(d0, d0, s0);
+            s1 = _mm512_fmadd_ps(d1, d1, s1);
+        }
+        for (; i < n; i += 16) {
+            __mmask16 mask = avx512Mask(n - i);
+            __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                    _mm512_maskz_loadu_ps(mask, b + i));
+            s0 = _mm512_fmadd_ps(d, d, s0);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+    }
+
+    __attribute__((target("avx512f")))
+    static double avx512Dot(const float* a, const float* b, const size_t n) {
+        __m512 s0 = _mm512_setzero_ps(), s1 = s0;
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+            s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), s1);
+        }
+        for (; i < n; i += 16) {
+            __mmask16 mask = avx512Mask(n - i);
+            s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                    _mm512_maskz_loadu_ps(mask, b + i), s0);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+    }
+
+    __attribute__((target("avx512f")))
+    static double avx512Cosine(const float* a, const float* b, const size_t n) {
+        __m512 dot0 = _mm512_setzero_ps(), dot1 = dot0;
+        __m512 normA0 = dot0, normA1 = dot0, normB0 = dot0, normB1 = dot0;
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m512 a0 = _mm512_loadu_ps(a + i), a1 = _mm512_loadu_ps(a + i + 16);
+            __m512 b0 = _mm512_loadu_ps(b + i), b1 = _mm512_loadu_ps(b + i + 16);
+            dot0 = _mm512_fmadd_ps(a0, b0, dot0);
+            dot1 = _mm512_fmadd_ps(a1, b1, dot1);
+            normA0 = _mm512_fmadd_ps(a0, a0, normA0);
+            normA1 = _mm512_fmadd_ps(a1, a1, normA1);
+            normB0 = _mm512_fmadd_ps(b0, b0, normB0);
+            normB1 = _mm512_fmadd_ps(b1, b1, normB1);
+        }
+        for (; i < n; i += 16) {
+            __mmask16 mask = avx512Mask(n - i);
+            __m512 a0 = _mm512_maskz_loadu_ps(mask, a + i);
+            __m512 b0 = _mm512_maskz_loadu_ps(mask, b + i);
+            dot0 = _mm512_fmadd_ps(a0, b0, dot0);
+            normA0 = _mm512_fmadd_ps(a0, a0, normA0);
+            normB0 = _mm512_fmadd_ps(b0, b0, normB0);
+        }
+        return cosine(_mm512_reduce_add_ps(_mm512_add_ps(dot0, dot1)),
+                _mm512_reduce_add_ps(_mm512_add_ps(normA0, normA1)),
+                _mm512_reduce_add_ps(_mm512_add_ps(normB0, normB1)));
+    }
+
+    __attribute__((target("avx512f")))
+    static void avx512AddMult(float* y, const float* x, const float coef,
+            const size_t n) {
+        const __m512 c = _mm512_set1_ps(coef);
+        for (size_t i = 0; i < n; i += 16) {
+            __mmask16 mask = avx512Mask(n - i);
+            _mm512_mask_storeu_ps(y + i, mask, _mm512_fmadd_ps(c,
+                    _mm512_maskz_loadu_ps(mask, x + i),
+                    _mm512_maskz_loadu_ps(mask, y + i)));
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    static void avx512Scale(float* y, const float coef, const size_t n) {
+        const __m512 c = _mm512_set1_ps(coef);
+        for (size_t i = 0; i < n; i += 16) {
+            __mmask16 mask = avx512Mask(n - i);
+            _mm512_mask_storeu_ps(y + i, mask, _mm512_mul_ps(c,
+                    _mm512_maskz_loadu_ps(mask, y + i)));
+        }
+    }
+
+    static inline __mmask16 avx512Mask(const size_t remaining) {
+        return remaining >= 16 ? __mmask16(0xffff)
+                : __mmask16((1u << remaining) - 1);
+    }
+#endif
+
+    static vector<FloatKernel> createKernels() {
+        vector<FloatKernel> kernels;
+        kernels.push_back({"scalar", &FloatKernels::scalarSquaredDistance,
+                &FloatKernels::scalarDot, &FloatKernels::scalarCosine,
+                &FloatKernels::scalarAddMult, &FloatKernels::scalarScale, true});
+#ifdef LMW_FLOAT_X86
+        __builtin_cpu_init();
+        kernels.push_back({"avx2", &FloatKernels::avx2SquaredDistance,
+                &FloatKernels::avx2Dot, &FloatKernels::avx2Cosine,
+                &FloatKernels::avx2AddMult, &FloatKernels::avx2Scale,
+                __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")});
+        kernels.push_back({"avx512", &FloatKernels::avx512SquaredDistance,
+                &FloatKernels::avx512Dot, &FloatKernels::avx512Cosine,
+                &FloatKernels::avx512AddMult, &FloatKernels::avx512Scale,
+                bool(__builtin_cpu_supports("avx512f"))});
+#endif
+        return kernels;
+    }
+
+    /**
+     * Kernels are ordered from slowest to fastest, so the last supported
+     * kernel is chosen unless LMW_FLOAT_KERNEL names another one.
+     */
+    static const FloatKernel& selectKernel() {
+        const vector<FloatKernel>& kernels = all();
+        const char* name = std::getenv("LMW_FLOAT_KERNEL");
+        if (name) {
+            for (const FloatKernel& kernel : kernels) {
+                if (kernel.supported && std::strcmp(kernel.name, name) == 0) {
+                    return kernel;
+                }
+            }
+        }
+        size_t selected = 0;
+        for (size_t i = 0; i < kernels.size(); ++i) {
+            if (kernels[i].supported) {
+                selected = i;
+            }
+        }
+        return kernels[selected];
+    }
+};
+
+} // namespace lmw
+
+#endif	/* FLOAT_KERNELS_H */
@@ -0,0 +1,6 @@
+/**
+ * The explicit instantiations in the lmw library. See LMWTree.h.
+ */
+
+#define LMW_INSTANTIATE
+#include "LMWTree.h"
@@ -1,16 +1,35 @@
 #ifndef KMEANS_H
 #define KMEANS_H
 
+#include "Accumulator.h"
 #include "Cluster.h"
 #include "Clusterer.h"
 #include "Seeder.h"
 #include "StdIncludes.h"
 #include "tbb/atomic.h"
 #include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
 #include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
 
 namespace lmw {
 
+/**
+ * Which triangle inequality bounds KMeans uses to skip distance calculations.
+ * See KMeans::setTriangleBounds().
+ */
+enum TriangleBounds {
+    NO_BOUNDS, HAMERLY_BOUNDS, ELKAN_BOUNDS
+};
+
+/**
+ * When the OPTIMIZER's prototype_reduction is enabled (see Prototype.h),
+ * centroids are recalculated by a parallel reduction over all vectors into
+ * thread-local accumulators for each cluster, so the work is balanced however
+ * skewed the cluster sizes are. The lists of nearest vectors in each Cluster
+ * are then only built once clustering has finished. Otherwise the lists are
+ * built every iteration and each centroid is calculated from its list.
+ */
 template <typename T, typename SEEDER, typename OPTIMIZER>
 class KMeans : public Clusterer<T> {
 public:
@@ -25,6 +44,7 @@ public:
     ~KMeans() {
         // Need to clean up any created cluster objects
         Utils::purge(_clusters);
+        Utils::purge(_previousCentroids);
     }
 
     //vector<size_t>& getNearestCentroids() {
@@ -43,6 +63,26 @@ public:
         _enforceNumClusters = enforceNumClusters;
     }
 
+    /**
+     * Triangle inequality bounds skip distance calculations after the first
+     * iteration while producing the same assignments. Each vector keeps an
+     * upper bound on the distance to its centroid and lower bounds on the
+     * distance to the other centroids. The bounds are loosened by how far
+     * centroids move, and distances are only calculated when they overlap.
+     *
+     * HAMERLY_BOUNDS keeps one lower bound per vector for all other centroids,
+     * so it needs little memory but a single centroid moving far loosens it
+     * for every vector. ELKAN_BOUNDS keeps a lower bound for every centroid,
+     * which takes data.size() * k floats but skips far more distances when
+     * k is large or the vectors have many dimensions.
+     *
+     * The DISTANCE must be a metric, such as hammingDistance, and the
+     * COMPARATOR must be Minimize. They are disabled by default.
+     */
+    void setTriangleBounds(TriangleBounds triangleBounds) {
+        _triangleBounds = triangleBounds;
+    }
+
     int numClusters() {
         return _numClusters;
     }
@@ -71,24 +111,31 @@ public:
     }
 
 private:
+    typedef typename OPTIMIZER::prototype_reduction PrototypeReduction;
+
+    typedef std::integral_constant<bool, PrototypeReduction::enabled> Reduction;
+
     void finalizeClusters(vector<T*> &data) {      
+        if (Reduction::value) {
+            buildNearestLists(data);
+        }
         // Create list of final clusters to return;
         bool emptyCluster = assignClusters(data);
         if (emptyCluster && _enforceNumClusters) {
             // randomly shuffle if k cluster were not created to enforce the number of clusters if required
             //std::cout << std::endl << "k-means is splitting randomly";
-            vector<T*> shuffled(data);
+            // the random partition is kept as the final assignment because
+            // nearest centroids could leave a cluster empty again
+            vector<size_t> shuffled(data.size());
+            std::iota(shuffled.begin(), shuffled.end(), 0);
             std::random_shuffle(shuffled.begin(), shuffled.end());
-            {
-                size_t step = shuffled.size(), i = 0, clusterIndex = 0;
-                for (; i < shuffled.size(); i += step, ++clusterIndex) {
-                    for (size_t j = i; j < i + step && j < shuffled.size(); ++j) {
-                        _nearestCentroid[j] = clusterIndex;
-                    }
-                }
+            clearBounds();
+            for (size_t j = 0; j < shuffled.size(); ++j) {
+                _nearestCentroid[shuffled[j]] = j * _clusters.size() / shuffled.size();
             }
-            vectorsToNearestCentroid(data);
+            buildNearestLists(data);
             recalculateCentroids(data);
+            _finalClusters.clear();
             assignClusters(data);
         }
     }
@@ -115,6 +162,7 @@ private:
         _iterCount = 0;
         _numClusters = clusters;
         _nearestCentroid.resize(data.size());
+        clearBounds();
         _seeder->seed(data, _centroids, _numClusters);
 
         // Create as many cluster objects as there are centroids
@@ -137,7 +185,7 @@ private:
         _iterCount = 1;
 		
 		// For testing
-		std::cout << endl << "Iteration: " << _iterCount << "\t" << getRMSE();
+		std::cout << endl << "Iteration: " << _iterCount << "\t" << getRMSE(data);
 
         while (!_converged) {
             vectorsToNearestCentroid(data);
@@ -145,7 +193,7 @@ private:
             _iterCount++;
 
 			// For testing
-			// std::cout << endl << "Iteration: " << _iterCount << "\t" << getRMSE();
+			// std::cout << endl << "Iteration: " << _iterCount << "\t" << getRMSE(data);
 			
             if (_maxIters != -1 && _iterCount >= _maxIters) {
 
@@ -171,32 +219,65 @@ private:
         _converged = true;
 
         // Parallel
-        tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
-                [&](const tbb::blocked_range<size_t>& r) {
-                    for (size_t i = r.begin(); i != r.end(); ++i) {
-                        //size_t nearest = nearestObj(data[i], _centroids);
-                        auto nearest = _optimizer.nearest(data[i], _centroids);
-                        if (nearest.index != _nearestCentroid[i]) {
-                            _converged = false;
+        if (_triangleBounds == HAMERLY_BOUNDS) {
+            boundedNearestCentroid(data);
+        } else if (_triangleBounds == ELKAN_BOUNDS) {
+            elkanNearestCentroid(data);
+        } else {
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
+                    [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                            //size_t nearest = nearestObj(data[i], _centroids);
+                            auto nearest = _optimizer.nearest(data[i], _centroids);
+                            if (nearest.index != _nearestCentroid[i]) {
+                                _converged = false;
+                            }
+                            _nearestCentroid[i] = nearest.index;
                         }
-                        _nearestCentroid[i] = nearest.index;
                     }
-                }
-        );
+            );
+        }
         tbb::atomic_fence(); // make sure all writes are visible on all CPUs
 
-        // Serial
-        // Clear the nearest vectors in each cluster
-        for (Cluster<T> *c : _clusters) {
-            c->clearNearest();
+        if (!Reduction::value) {
+            buildNearestLists(data);
+        }
+    }
+
+    /**
+     * Puts each vector in the list of its nearest centroid's cluster. The
+     * lists keep the order of data.
+     */
+    void buildNearestLists(vector<T*> &data) {
+        vector<size_t> sizes(_clusters.size(), 0);
+        for (size_t nearest : _nearestCentroid) {
+            sizes[nearest]++;
+        }
+        for (size_t j = 0; j < _clusters.size(); j++) {
+            _clusters[j]->clearNearest();
+            _clusters[j]->getNearestList().reserve(sizes[j]);
         }
-        // Accumlate into clusters
         for (size_t i = 0; i < data.size(); i++) {
-            size_t nearest = _nearestCentroid[i];
-            _clusters[nearest]->addNearest(data[i]);
+            _clusters[_nearestCentroid[i]]->addNearest(data[i]);
         }
+    }
 
-
+    /**
+     * The RMSE of the current assignment, calculated from data rather than
+     * the lists of nearest vectors.
+     */
+    double getRMSE(vector<T*> &data) {
+        double SSE = tbb::parallel_reduce(
+                tbb::blocked_range<size_t>(0, data.size(), 1000), 0.0,
+                [&](const tbb::blocked_range<size_t>& r, double SSE) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        SSE += _optimizer.squaredDistance(
+                                _centroids[_nearestCentroid[i]], data[i]);
+                    }
+                    return SSE;
+                },
+                std::plus<double>());
+        return sqrt(SSE / data.size());
     }
 
     /**
@@ -206,6 +287,30 @@ private:
      * Post: centroids has been updated with new vector data
      */
     void recalculateCentroids(vector<T*> &data) {
+        const bool updateBounds = _triangleBounds != NO_BOUNDS && !_upper.empty();
+        if (updateBounds) {
+            // keep the old centroids to measure how far they move, reusing
+            // the copies from the previous iteration
+            while (_previousCentroids.size() > _centroids.size()) {
+                delete _previousCentroids.back();
+                _previousCentroids.pop_back();
+            }
+            for (size_t i = 0; i < _centroids.size(); ++i) {
+                if (i < _previousCentroids.size()) {
+                    *_previousCentroids[i] = *_centroids[i];
+                } else {
+                    _previousCentroids.push_back(new T(*_centroids[i]));
+                }
+            }
+        }
+        updateCentroids(data, Reduction());
+        tbb::atomic_fence(); // make sure all writes are visible on all CPUs
+        if (updateBounds) {
+            loosenBounds();
+        }
+    }
+
+    void updateCentroids(vector<T*> &data, std::false_type) {
         tbb::parallel_for(tbb::blocked_range<size_t>(0, _clusters.size(), 2),
                 [&](const tbb::blocked_range<size_t>& r) {
                     for (size_t i = r.begin(); i != r.end(); ++i) {
@@ -216,7 +321,315 @@ private:
                     }
                 }
         );
-        tbb::atomic_fence(); // make sure all writes are visible on all CPUs
+    }
+
+    /**
+     * Each thread sums the vectors it is given into its own accumulator for
+     * their cluster, created the first time it needs one. The accumulators of
+     * each cluster are then merged and turned into its centroid.
+     */
+    void updateCentroids(vector<T*> &data, std::true_type) {
+        typedef typename PrototypeReduction::Accumulator Accumulator;
+        struct Sum {
+            Accumulator* accumulator;
+            uint64_t count;
+        };
+        const size_t k = _centroids.size();
+        const size_t dimensions = _centroids[0]->size();
+        tbb::enumerable_thread_specific<vector<Sum>> sums(vector<Sum>(k, Sum{NULL, 0}));
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    vector<Sum>& local = sums.local();
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        Sum& sum = local[_nearestCentroid[i]];
+                        if (!sum.accumulator) {
+                            sum.accumulator = new Accumulator(dimensions);
+                            sum.accumulator->setAll(0);
+                        }
+                        accumulate(*sum.accumulator, *data[i]);
+                        sum.count++;
+                    }
+                }
+        );
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, k),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t j = r.begin(); j != r.end(); ++j) {
+                        Accumulator* total = NULL;
+                        uint64_t count = 0;
+                        for (vector<Sum>& local : sums) {
+                            Sum& sum = local[j];
+                            if (!sum.accumulator) {
+                                continue;
+                            }
+                            if (total) {
+                                mergeAccumulator(*total, *sum.accumulator);
+                            } else {
+                                total = sum.accumulator;
+                            }
+                            count += sum.count;
+                        }
+                        if (count > 0) {
+                            PrototypeReduction::prototype(_centroids[j], *total, count);
+                        }
+                    }
+                }
+        );
+        for (vector<Sum>& local : sums) {
+            for (Sum& sum : local) {
+                delete sum.accumulator;
+            }
+        }
+    }
+
+    void clearBounds() {
+        _upper.clear();
+        _lower.clear();
+        _centroidLower.clear();
+    }
+
+    /**
+     * @return the largest float not greater than distance, so that a lower
+     *         bound stays a lower bound when it is stored as a float
+     */
+    static float lowerFloat(double distance) {
+        float bound = static_cast<float>(distance);
+        if (bound > distance) {
+            bound = std::nextafter(bound, -std::numeric_limits<float>::infinity());
+        }
+        return bound;
+    }
+
+    /**
+     * @return the distance between every pair of centroids, as a row for each
+     *         centroid
+     */
+    vector<double> centroidDistances() {
+        const size_t k = _centroids.size();
+        vector<double> distances(k * k, 0);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, k),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t j = r.begin(); j != r.end(); ++j) {
+                        for (size_t other = j + 1; other < k; ++other) {
+                            double distance = _optimizer.distance(_centroids[j], _centroids[other]);
+                            distances[j * k + other] = distance;
+                            distances[other * k + j] = distance;
+                        }
+                    }
+                }
+        );
+        return distances;
+    }
+
+    /**
+     * @return half the distance from each centroid to the nearest other
+     *         centroid
+     */
+    vector<double> halfSeparations(const vector<double>& distances) {
+        const size_t k = _centroids.size();
+        vector<double> halfSeparation(k);
+        for (size_t j = 0; j < k; ++j) {
+            double separation = std::numeric_limits<double>::max();
+            for (size_t other = 0; other < k; ++other) {
+                if (other != j) {
+                    separation = std::min(separation, distances[j * k + other]);
+                }
+            }
+            halfSeparation[j] = separation / 2;
+        }
+        return halfSeparation;
+    }
+
+    /**
+     * Finds the nearest and second nearest centroid to data[i] and sets its
+     * assignment and bounds exactly. Ties go to the lowest index as in
+     * Optimizer::nearest().
+     */
+    void nearestTwoCentroids(vector<T*> &data, const size_t i) {
+        size_t nearest = 0;
+        double nearestDistance = std::numeric_limits<double>::max();
+        double secondDistance = std::numeric_limits<double>::max();
+        for (size_t j = 0; j < _centroids.size(); ++j) {
+            double distance = _optimizer.distance(data[i], _centroids[j]);
+            if (distance < nearestDistance) {
+                secondDistance = nearestDistance;
+                nearestDistance = distance;
+                nearest = j;
+            } else if (distance < secondDistance) {
+                secondDistance = distance;
+            }
+        }
+        if (nearest != _nearestCentroid[i]) {
+            _converged = false;
+        }
+        _nearestCentroid[i] = nearest;
+        _upper[i] = nearestDistance;
+        _lower[i] = secondDistance;
+    }
+
+    /**
+     * Assigns vectors to their nearest centroid using the bounds. The first
+     * call after seeding searches all centroids to set the bounds.
+     */
+    void boundedNearestCentroid(vector<T*> &data) {
+        if (_upper.size() != data.size()) {
+            _upper.resize(data.size());
+            _lower.resize(data.size());
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
+                    [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                            nearestTwoCentroids(data, i);
+                        }
+                    }
+            );
+            return;
+        }
+
+        const vector<double> halfSeparation = halfSeparations(centroidDistances());
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        const size_t assigned = _nearestCentroid[i];
+                        const double bound = std::max(halfSeparation[assigned], _lower[i]);
+                        if (_upper[i] < bound) {
+                            continue;
+                        }
+                        // tighten the upper bound and try again
+                        _upper[i] = _optimizer.distance(data[i], _centroids[assigned]);
+                        if (_upper[i] < bound) {
+                            continue;
+                        }
+                        nearestTwoCentroids(data, i);
+                    }
+                }
+        );
+    }
+
+    /**
+     * Finds the nearest centroid to data[i] by calculating the distance to
+     * every centroid, and sets its assignment and all of its bounds exactly.
+     */
+    void allCentroidDistances(vector<T*> &data, const size_t i) {
+        const size_t k = _centroids.size();
+        float* lower = &_centroidLower[i * k];
+        size_t nearest = 0;
+        double nearestDistance = std::numeric_limits<double>::max();
+        for (size_t j = 0; j < k; ++j) {
+            double distance = _optimizer.distance(data[i], _centroids[j]);
+            lower[j] = lowerFloat(distance);
+            if (distance < nearestDistance) {
+                nearestDistance = distance;
+                nearest = j;
+            }
+        }
+        if (nearest != _nearestCentroid[i]) {
+            _converged = false;
+        }
+        _nearestCentroid[i] = nearest;
+        _upper[i] = nearestDistance;
+    }
+
+    /**
+     * Assigns vectors to their nearest centroid using a lower bound for every
+     * centroid (Elkan's algorithm). A centroid is skipped when its lower bound
+     * or half its distance from the assigned centroid exceeds the upper bound,
+     * because it must then be strictly further away. Ties go to the lowest
+     * index as in Optimizer::nearest().
+     */
+    void elkanNearestCentroid(vector<T*> &data) {
+        const size_t k = _centroids.size();
+        if (_upper.size() != data.size()) {
+            _upper.resize(data.size());
+            _centroidLower.resize(data.size() * k);
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
+                    [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                            allCentroidDistances(data, i);
+                        }
+                    }
+            );
+            return;
+        }
+
+        const vector<double> distances = centroidDistances();
+        const vector<double> halfSeparation = halfSeparations(distances);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        const size_t previous = _nearestCentroid[i];
+                        size_t assigned = previous;
+                        double upper = _upper[i];
+                        if (upper < halfSeparation[assigned]) {
+                            continue;
+                        }
+                        float* lower = &_centroidLower[i * k];
+                        bool tight = false;
+                        for (size_t j = 0; j < k; ++j) {
+                            if (j == assigned || upper < lower[j]
+                                    || upper < distances[assigned * k + j] / 2) {
+                                continue;
+                            }
+                            if (!tight) {
+                                // tighten the upper bound and try again
+                                upper = _optimizer.distance(data[i], _centroids[assigned]);
+                                lower[assigned] = lowerFloat(upper);
+                                tight = true;
+                                if (upper < lower[j]
+                                        || upper < distances[assigned * k + j] / 2) {
+                                    continue;
+                                }
+                            }
+                            double distance = _optimizer.distance(data[i], _centroids[j]);
+                            lower[j] = lowerFloat(distance);
+                            if (distance < upper || (distance == upper && j < assigned)) {
+                                upper = distance;
+                                assigned = j;
+                            }
+                        }
+                        if (assigned != previous) {
+                            _converged = false;
+                        }
+                        _nearestCentroid[i] = assigned;
+                        _upper[i] = upper;
+                    }
+                }
+        );
+    }
+
+    /**
+     * Widens the bounds by how far each centroid moved in the last update.
+     */
+    void loosenBounds() {
+        vector<double> moved(_centroids.size());
+        size_t furthest = 0;
+        double maxMoved = 0, secondMoved = 0;
+        for (size_t j = 0; j < _centroids.size(); ++j) {
+            moved[j] = _optimizer.distance(_previousCentroids[j], _centroids[j]);
+            if (moved[j] > maxMoved) {
+                secondMoved = maxMoved;
+                maxMoved = moved[j];
+                furthest = j;
+            } else if (moved[j] > secondMoved) {
+                secondMoved = moved[j];
+            }
+        }
+        const size_t k = _centroids.size();
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, _upper.size(), 1000),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        const size_t assigned = _nearestCentroid[i];
+                        _upper[i] += moved[assigned];
+                        if (_triangleBounds == HAMERLY_BOUNDS) {
+                            _lower[i] -= assigned == furthest ? secondMoved : maxMoved;
+                        } else {
+                            float* lower = &_centroidLower[i * k];
+                            for (size_t j = 0; j < k; ++j) {
+                                lower[j] = lowerFloat(std::max(0.0, lower[j] - moved[j]));
+                            }
+                        }
+                    }
+                }
+        );
     }
 
     SEEDER *_seeder;
@@ -253,6 +666,22 @@ private:
     
     // has the clustering converged
     atomic<bool> _converged;    
+
+    // Use triangle inequality bounds to skip distance calculations.
+    TriangleBounds _triangleBounds = NO_BOUNDS;
+
+    // Upper bound on the distance from each vector to its nearest centroid.
+    vector<double> _upper;
+
+    // Lower bound on the distance from each vector to any other centroid.
+    vector<double> _lower;
+
+    // Lower bound on the distance from each vector to every centroid, as a
+    // row of k for each vector (Elkan only).
+    vector<float> _centroidLower;
+
+    // The centroids before the last update, used to loosen the bounds.
+    vector<T*> _previousCentroids;
 };
 
 } // namespace lmw
@@ -0,0 +1,235 @@
+#ifndef KMEANSPARALLELSEEDER_H
+#define	KMEANSPARALLELSEEDER_H
+
+#include "Seeder.h"
+#include "StdIncludes.h"
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
+
+namespace lmw {
+
+/**
+ * KMeansParallelSeeder chooses seeds with k-means|| (Bahmani et al.,
+ * Scalable K-Means++, 2012). Like k-means++ it prefers vectors far from the
+ * seeds chosen so far, but rather than one seed per pass over the data it
+ * samples about oversampling * k candidates per pass in a few rounds. Every
+ * vector is then weighted by how many vectors are nearest to it, and the
+ * candidates are reduced to k seeds with weighted k-means++.
+ *
+ * Each round is a parallel pass over the data that only calculates the
+ * distances to the candidates chosen in the previous round. The random
+ * number for each vector in each round is a hash of its index, so the seeds
+ * do not depend on how the work was split over threads. The seeds are copies
+ * of vectors in data.
+ *
+ * DISTANCE must provide squared() (see Distance.h).
+ *
+ * For example,
+ *      KMeansParallelSeeder<SVector<bool>, hammingDistance> seeder;
+ *      seeder.seed(vectors, centroids, 1000);
+ */
+template <typename T, typename DISTANCE>
+class KMeansParallelSeeder : public Seeder<T> {
+public:
+
+    KMeansParallelSeeder() {
+    }
+
+    /**
+     * The number of sampling rounds after the first random seed.
+     */
+    void setRounds(int rounds) {
+        _rounds = rounds;
+    }
+
+    /**
+     * How many candidates are expected per round as a multiple of the
+     * number of seeds. The default of 0.5 with 5 rounds gives about 2.5 * k
+     * candidates, which seeds about as well as more candidates would.
+     */
+    void setOversampling(double oversampling) {
+        _oversampling = oversampling;
+    }
+
+    // Pre: The centroids vector is empty
+    void seed(vector<T*> &data, vector<T*> &centroids, int numCentres) {
+        centroids.clear();
+        if (data.empty() || numCentres <= 0) {
+            return;
+        }
+        const uint64_t seed = std::rand();
+        RND_ENG eng(seed);
+        RND_UNI_GEN_01 gen(eng, RND_UNIFORM01());
+        const size_t n = data.size();
+
+        // the squared distance from each vector to its nearest candidate
+        vector<double> cost(n, std::numeric_limits<double>::max());
+        vector<size_t> nearest(n, 0);
+        vector<size_t> candidates = {size_t(gen() * n) % n};
+        vector<size_t> added = candidates;
+        double totalCost = updateCost(data, candidates, added, cost, nearest);
+
+        const double expected = _oversampling * numCentres;
+        for (int round = 0; round < _rounds && totalCost > 0; ++round) {
+            added = sample(cost, totalCost, expected, seed, round);
+            candidates.insert(candidates.end(), added.begin(), added.end());
+            totalCost = updateCost(data, candidates, added, cost, nearest);
+        }
+
+        // weight each candidate by the number of vectors nearest to it
+        vector<double> weights(candidates.size(), 0);
+        for (size_t i = 0; i < n; ++i) {
+            weights[nearest[i]]++;
+        }
+
+        for (size_t index : recluster(data, candidates, weights, numCentres, gen)) {
+            centroids.push_back(new T(*data[index]));
+        }
+    }
+
+private:
+    /**
+     * Lowers the cost of each vector to the candidates just added, which start
+     * at candidates[candidates.size() - added.size()].
+     *
+     * @return the total cost
+     */
+    double updateCost(vector<T*> &data, const vector<size_t>& candidates,
+            const vector<size_t>& added, vector<double>& cost,
+            vector<size_t>& nearest) {
+        const size_t first = candidates.size() - added.size();
+        return tbb::parallel_reduce(
+                tbb::blocked_range<size_t>(0, data.size(), 1000), 0.0,
+                [&](const tbb::blocked_range<size_t>& r, double total) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        for (size_t j = 0; j < added.size(); ++j) {
+                            double distance = _distance.squared(data[i], data[added[j]]);
+                            if (distance < cost[i]) {
+                                cost[i] = distance;
+                                nearest[i] = first + j;
+                            }
+                        }
+                        total += cost[i];
+                    }
+                    return total;
+                },
+                std::plus<double>());
+    }
+
+    /**
+     * Chooses each vector independently with probability
+     * expected * cost / totalCost. Vectors that are already candidates have
+     * no cost and are never chosen again.
+     *
+     * @return the indexes of the chosen vectors in ascending order
+     */
+    vector<size_t> sample(const vector<double>& cost, const double totalCost,
+            const double expected, const uint64_t seed, const int round) {
+        tbb::enumerable_thread_specific<vector<size_t>> chosen;
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, cost.size(), 1000),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    vector<size_t>& local = chosen.local();
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        double p = expected * cost[i] / totalCost;
+                        if (cost[i] > 0 && uniform(seed, round, i) < p) {
+                            local.push_back(i);
+                        }
+                    }
+                }
+        );
+        vector<size_t> sampled;
+        for (const vector<size_t>& local : chosen) {
+            sampled.insert(sampled.end(), local.begin(), local.end());
+        }
+        std::sort(sampled.begin(), sampled.end());
+        return sampled;
+    }
+
+    /**
+     * @return a number in [0, 1) that only depends on its arguments
+     */
+    static double uniform(const uint64_t seed, const uint64_t round,
+            const uint64_t i) {
+        // splitmix64 finalizer
+        uint64_t x = seed + (round + 1) * 0x9E3779B97F4A7C15ULL + i * 0xD1B54A32D192ED03ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        x ^= x >> 31;
+        return (x >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    /**
+     * Chooses numCentres of the candidates with k-means++ where each
+     * candidate counts weights[j] times. If there are too few candidates,
+     * they are all used and the rest are random vectors.
+     *
+     * @return the indexes of the seeds in data
+     */
+    vector<size_t> recluster(vector<T*> &data, const vector<size_t>& candidates,
+            const vector<double>& weights, const int numCentres,
+            RND_UNI_GEN_01& gen) {
+        vector<size_t> seeds;
+        if (candidates.size() <= size_t(numCentres)) {
+            seeds = candidates;
+            for (size_t i = 0; seeds.size() < size_t(numCentres)
+                    && i < data.size(); ++i) {
+                size_t index = size_t(gen() * data.size()) % data.size();
+                seeds.push_back(index);
+            }
+            return seeds;
+        }
+        const size_t m = candidates.size();
+        vector<double> cost(m, std::numeric_limits<double>::max());
+        size_t chosen = choose(weights, gen);
+        for (;;) {
+            seeds.push_back(candidates[chosen]);
+            if (seeds.size() == size_t(numCentres)) {
+                break;
+            }
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, m, 100),
+                    [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t j = r.begin(); j != r.end(); ++j) {
+                            double distance = _distance.squared(
+                                    data[candidates[j]], data[candidates[chosen]]);
+                            cost[j] = std::min(cost[j], distance * weights[j]);
+                        }
+                    }
+            );
+            chosen = choose(cost, gen);
+        }
+        return seeds;
+    }
+
+    /**
+     * @return an index chosen with probability proportional to its weight,
+     *         or uniformly if all weights are 0
+     */
+    static size_t choose(const vector<double>& weights, RND_UNI_GEN_01& gen) {
+        double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+        if (total <= 0) {
+            return size_t(gen() * weights.size()) % weights.size();
+        }
+        double value = gen() * total;
+        for (size_t j = 0; j < weights.size() - 1; ++j) {
+            if (value < weights[j]) {
+                return j;
+            }
+            value -= weights[j];
+        }
+        return weights.size() - 1;
+    }
+
+    DISTANCE _distance;
+
+    // sampling rounds after the first seed
+    int _rounds = 5;
+
+    // expected candidates per round as a multiple of k
+    double _oversampling = 0.5;
+};
+
+} // namespace lmw
+
+#endif	/* KMEANSPARALLELSEEDER_H */
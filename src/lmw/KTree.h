@@ -7,6 +7,13 @@
 #include "KMeans.h"
 #include "NodeVisitor.h"
 
+#include "tbb/blocked_range.h"
+#include "tbb/concurrent_queue.h"
+#include "tbb/concurrent_vector.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+#include "tbb/spin_mutex.h"
+
 namespace lmw {
 
 template <typename T>
@@ -29,7 +36,9 @@ struct SplitResult {
 template <typename T, typename CLUSTERER, typename OPTIMIZER>
 class KTree {
 public:
-    KTree(int order, int clustererMaxiters) : _clusterer(2) {
+    KTree(int order, int clustererMaxiters) : _clusterer(2),
+            _clustererMaxIters(clustererMaxiters),
+            _localPrototypes(static_cast<T*>(NULL)) {
         _m = order;
         _root = new Node<T>(); // initial root is a leaf
         _clusterer.setMaxIters(clustererMaxiters);
@@ -41,6 +50,13 @@ public:
     
     ~KTree() {
         delete _root;
+        CLUSTERER* clusterer;
+        while (_clusterers.try_pop(clusterer)) {
+            delete clusterer;
+        }
+        for (T* prototype : _localPrototypes) {
+            delete prototype;
+        }
     }
 
     void setUpdateDelay(int updateDelay) {
@@ -52,7 +68,7 @@ public:
     }
 
     int getClusterCount() {
-        return clusterCount(_root);
+        return _root->getClusterCount();
     }
 
     int getClusterCount(int depth) {
@@ -64,7 +80,7 @@ public:
     }
 
     uint64_t getObjCount() {
-        return objCount(_root);
+        return _root->getObjCount();
     }
 
     int getLevelCount() {
@@ -104,15 +120,19 @@ public:
         for (int i = 0; i < removed.size(); i++) {
             pushDownNoUpdate(_root, removed[i]);
         }
+        _root->updateCountsRecursively();
+        _root->setSumSquaredError(-1);
 
         removed.clear();
     }
 
     int prune() {
+        _root->setSumSquaredError(-1);
         return prune(_root);
     }
 
     void rebuildInternal() {
+        _root->setSumSquaredError(-1);
         // rebuild starting with above leaf level (bottom up)
         for (int depth = getLevelCount() - 1; depth >= 1; --depth) {
             rebuildInternal(_root, depth);
@@ -120,16 +140,133 @@ public:
     }
 
     void add(T *obj) {
-        SplitResult<T> result = pushDown(_root, obj);
-        if (result.isSplit) {
-            _root = new Node<T>();
-            _root->add(result._key1, result._child1);
-            _root->add(result._key2, result._child2);
-            _root->setOwnsKeys(true);
-        }
+        insert(obj);
+        _root->setSumSquaredError(-1);
         ++_added;
     }
 
+    /**
+     * Adds all of data to the tree using many threads. The vectors are added
+     * concurrently in chunks. Each thread descends the tree under shared node
+     * latches and updates the nodes on its path under exclusive latches. The
+     * thread that overfills a leaf splits it with its own clusterer. It
+     * clusters without holding latches, and then links the new leaf into the
+     * parent under the latches of both. Leaves can briefly hold more than
+     * order vectors while they are split. If the parent is also full, the
+     * split is left to the end of the chunk. The extra vectors are then
+     * removed from the overfull leaves and added one at a time by add(T*).
+     *
+     * The tree is not the same as adding data in order with add(T*), because
+     * the order of insertion differs. It must not run concurrently with other
+     * member functions.
+     */
+    void add(vector<T*>& data) {
+        size_t next = 0;
+
+        // leaves are only split concurrently below an internal root
+        for (; next < data.size() && _root->isLeaf(); ++next) {
+            add(data[next]);
+        }
+        while (next < data.size()) {
+            const size_t chunk = std::max<size_t>(size_t(_m) * minConcurrentChunk,
+                    getObjCount() / concurrentGrowth);
+            const size_t end = std::min(data.size(), next + chunk);
+            tbb::parallel_for(tbb::blocked_range<size_t>(next, end),
+                    [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                            addConcurrently(data[i]);
+                        }
+                    }
+            );
+            finishConcurrentAdds();
+            next = end;
+        }
+        _root->setSumSquaredError(-1);
+    }
+
+    /**
+     * Builds the tree from data in one go. This tree must be empty. The leaves
+     * are built first by splitting data top down with k-means into groups of
+     * at most order vectors. The clusters at each step are split further in
+     * parallel. Each level above is then built in one pass by grouping the
+     * keys of the level below in the same way, until they fit in the root.
+     * Every leaf is at the same depth, so vectors can be added afterwards with
+     * add().
+     *
+     * Leaves are not as full as those of a tree built by add(), because
+     * k-means clusters are uneven in size.
+     */
+    void bulkLoad(vector<T*>& data) {
+        if (!_root->isLeaf() || !_root->isEmpty()) {
+            throw runtime_error("bulk loading requires an empty K-tree");
+        }
+        if (data.size() <= size_t(_m)) {
+            add(data);
+            return;
+        }
+
+        // leaf level
+        tbb::concurrent_vector<vector<T*>> groups;
+        partition(data, groups);
+        vector<Node<T>*> nodes(groups.size());
+        vector<T*> keys(groups.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, groups.size()),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        nodes[i] = new Node<T>();
+                        nodes[i]->addAll(groups[i]);
+                        nodes[i]->updateCounts();
+                        keys[i] = new T(*groups[i][0]);
+                        updatePrototype(nodes[i], keys[i]);
+                    }
+                }
+        );
+
+        // internal levels, bottom up
+        while (nodes.size() > size_t(_m)) {
+            unordered_map<T*, Node<T>*> nodeOf;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                nodeOf[keys[i]] = nodes[i];
+            }
+            groups.clear();
+            partition(keys, groups);
+            nodes.assign(groups.size(), NULL);
+            keys.assign(groups.size(), NULL);
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, groups.size()),
+                    [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                            nodes[i] = new Node<T>();
+                            for (T* key : groups[i]) {
+                                nodes[i]->add(key, nodeOf.at(key));
+                            }
+                            nodes[i]->setOwnsKeys(true);
+                            nodes[i]->updateCounts();
+                            keys[i] = new T(*groups[i][0]);
+                            updatePrototype(nodes[i], keys[i]);
+                        }
+                    }
+            );
+        }
+
+        delete _root;
+        _root = new Node<T>();
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            _root->add(keys[i], nodes[i]);
+        }
+        _root->setOwnsKeys(true);
+        _root->updateCounts();
+        _added += data.size();
+        _root->setSumSquaredError(-1);
+    }
+
+    // chunks of add(vector<T*>&) add at most 1 / concurrentGrowth of the
+    // vectors already in the tree, so few leaves overflow in one chunk
+    static const size_t concurrentGrowth = 8;
+
+    // chunks of add(vector<T*>&) have at least minConcurrentChunk * order
+    // vectors
+    static const size_t minConcurrentChunk = 16;
+
     double getRMSE() {
         return RMSE();
     }
@@ -145,9 +282,265 @@ public:
 
 
 private:
+    typedef typename Node<T>::Latch Latch;
+
+    void insert(T* obj) {
+        SplitResult<T> result = pushDown(_root, obj);
+        if (result.isSplit) {
+            _root = new Node<T>();
+            _root->add(result._key1, result._child1);
+            _root->add(result._key2, result._child2);
+            _root->setOwnsKeys(true);
+            _root->updateCounts();
+        }
+    }
+
+    /**
+     * Splits items with k-means into at most order clusters until every group
+     * has at most order items, and appends the groups to groups. Clusters
+     * are split further in parallel. Empty clusters are dropped rather than
+     * enforcing k clusters, which would split items randomly, and items that
+     * k-means cannot separate are split into groups in order.
+     */
+    void partition(vector<T*>& items, tbb::concurrent_vector<vector<T*>>& groups) {
+        if (items.size() <= size_t(_m)) {
+            groups.push_back(items);
+            return;
+        }
+        const size_t k = std::max<size_t>(2,
+                std::min<size_t>(_m, (items.size() + _m - 1) / _m));
+        vector<vector<T*>> parts;
+        CLUSTERER* clusterer = borrowClusterer(k, false);
+        for (Cluster<T>* cluster : clusterer->cluster(items)) {
+            parts.push_back(cluster->getNearestList());
+            delete cluster->getCentroid();
+        }
+        returnClusterer(clusterer);
+        if (parts.size() < 2) {
+            parts.clear();
+            for (size_t i = 0; i < items.size(); i += _m) {
+                parts.push_back(vector<T*>(items.begin() + i,
+                        items.begin() + std::min(items.size(), i + _m)));
+            }
+        }
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, parts.size()),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        partition(parts[i], groups);
+                    }
+                }
+        );
+    }
+
+    /**
+     * Adds obj to its nearest leaf and then updates the counts and the
+     * prototypes on the path to it, bottom up. The root must be internal. It
+     * is thread safe with other calls to addConcurrently() but the structure
+     * above the leaves does not change.
+     */
+    void addConcurrently(T* obj) {
+        const size_t added = _added++;
+
+        // descend, remembering the index of the child taken in each node
+        vector<Node<T>*> path;
+        vector<size_t> indexes;
+        Node<T>* leaf = _root;
+        while (true) {
+            typename Latch::scoped_lock lock(leaf->getLatch(), false);
+            if (leaf->isLeaf()) {
+                break;
+            }
+            size_t nearest = _optimizer.nearest(obj, leaf->getKeys()).index;
+            path.push_back(leaf);
+            indexes.push_back(nearest);
+            leaf = leaf->getChild(nearest);
+        }
+
+        vector<T*> toSplit;
+        {
+            typename Latch::scoped_lock lock(leaf->getLatch(), true);
+            leaf->add(obj);
+            leaf->updateCounts();
+            if (leaf->size() > _m && beginSplit(leaf)) {
+                toSplit = leaf->getKeys();
+            }
+        }
+        bool split = !toSplit.empty()
+                && splitConcurrently(path.back(), indexes.back(), leaf, toSplit);
+
+        for (size_t level = path.size(); level-- > 0;) {
+            path[level]->addCounts(1, split ? 1 : 0);
+            if (!_delayedUpdates || (_delayedUpdates && added % _updateDelay == 0)) {
+                updatePrototypeConcurrently(path[level], indexes[level]);
+            }
+        }
+    }
+
+    /**
+     * Splits leaf, the child at index in parent, with this thread's
+     * clusterer. No latches are held while clustering. The clusterer runs
+     * parallel loops, and TBB may run other insertions on this thread while
+     * it waits for them. Vectors added to leaf in the meantime go to the half
+     * with the nearer key. Returns false and leaves the split to
+     * finishConcurrentAdds() if parent has no room for another child.
+     */
+    bool splitConcurrently(Node<T>* parent, const size_t index, Node<T>* leaf,
+            vector<T*>& keys) {
+        {
+            typename Latch::scoped_lock lock(parent->getLatch(), false);
+            if (parent->size() >= _m) {
+                return false;
+            }
+        }
+        CLUSTERER* clusterer = borrowClusterer(2, true);
+        vector<Cluster<T>*>& clusters = clusterer->cluster(keys);
+        T* key1 = clusters[0]->getCentroid();
+        T* key2 = clusters[1]->getCentroid();
+        vector<T*>& nearest2 = clusters[1]->getNearestList();
+        unordered_set<T*> second(nearest2.begin(), nearest2.end());
+        returnClusterer(clusterer);
+        const vector<T*> centroids = {key1, key2};
+        const size_t clustered = keys.size();
+
+        typename Latch::scoped_lock parentLock(parent->getLatch(), true);
+        if (parent->size() >= _m) {
+            delete key1;
+            delete key2;
+            return false;
+        }
+        Node<T>* node2 = new Node<T>();
+        {
+            typename Latch::scoped_lock leafLock(leaf->getLatch(), true);
+            keys = leaf->getKeys();
+            leaf->clearKeysAndChildren();
+            for (size_t i = 0; i < keys.size(); ++i) {
+                bool toNode2 = i < clustered ? second.count(keys[i]) > 0
+                        : _optimizer.nearest(keys[i], centroids).index == 1;
+                if (toNode2) {
+                    node2->add(keys[i]);
+                } else {
+                    leaf->add(keys[i]);
+                }
+            }
+            leaf->updateCounts();
+            node2->updateCounts();
+            updatePrototype(leaf, parent->getKey(index));
+            updatePrototype(node2, key2);
+            endSplit(leaf);
+        }
+        parent->add(key2, node2);
+        delete key1;
+        return true;
+    }
+
+    /**
+     * Updates the key of child index in parent. The prototype is calculated
+     * into a thread local vector under a shared latch on the child, so the
+     * parent is only latched exclusively to copy it.
+     */
+    void updatePrototypeConcurrently(Node<T>* parent, const size_t index) {
+        T*& prototype = _localPrototypes.local();
+        Node<T>* child;
+        {
+            typename Latch::scoped_lock lock(parent->getLatch(), false);
+            child = parent->getChild(index);
+            if (!prototype) {
+                prototype = new T(*parent->getKey(index));
+            }
+        }
+        {
+            typename Latch::scoped_lock lock(child->getLatch(), false);
+            updatePrototype(child, prototype);
+        }
+        typename Latch::scoped_lock lock(parent->getLatch(), true);
+        *parent->getKey(index) = *prototype;
+    }
+
+    /**
+     * Removes the vectors that overfilled leaves during concurrent adds and
+     * adds them one at a time, splitting as many nodes as needed.
+     */
+    void finishConcurrentAdds() {
+        vector<T*> overflow;
+        removeOverflow(_root, overflow);
+        _splitting.clear();
+        for (T* obj : overflow) {
+            insert(obj);
+        }
+    }
+
+    /**
+     * Moves the vectors beyond _m in each leaf below n to overflow and
+     * recounts every node, bottom up. The keys on the path to a truncated
+     * leaf still include its overflow, so they are recalculated from the
+     * new counts. Returns whether anything below n was removed.
+     */
+    bool removeOverflow(Node<T>* n, vector<T*>& overflow) {
+        bool removed = false;
+        if (n->isLeaf()) {
+            vector<T*>& keys = n->getKeys();
+            if (keys.size() > _m) {
+                overflow.insert(overflow.end(), keys.begin() + _m, keys.end());
+                keys.resize(_m);
+                removed = true;
+            }
+        } else {
+            for (size_t i = 0; i < n->size(); i++) {
+                Node<T>* child = n->getChild(i);
+                if (removeOverflow(child, overflow)) {
+                    updatePrototype(child, n->getKey(i));
+                    removed = true;
+                }
+            }
+        }
+        n->updateCounts();
+        return removed;
+    }
+
+    // Only one thread splits a leaf at a time. Returns false if leaf is
+    // already being split.
+    bool beginSplit(Node<T>* leaf) {
+        tbb::spin_mutex::scoped_lock lock(_splittingMutex);
+        return _splitting.insert(leaf).second;
+    }
+
+    void endSplit(Node<T>* leaf) {
+        tbb::spin_mutex::scoped_lock lock(_splittingMutex);
+        _splitting.erase(leaf);
+    }
+
+    /**
+     * Takes a clusterer from the pool, or constructs one if the pool is empty,
+     * and sets it to find k clusters. A clusterer is borrowed for one call to
+     * cluster() rather than kept per thread, because a thread waiting on the
+     * parallel loops inside cluster() can steal another task that clusters.
+     * Clusterers are reused because constructing one can be expensive, e.g.
+     * the bit prototypes build a lookup table.
+     */
+    CLUSTERER* borrowClusterer(const size_t k, const bool enforceNumClusters) {
+        CLUSTERER* clusterer;
+        if (!_clusterers.try_pop(clusterer)) {
+            clusterer = new CLUSTERER(k);
+            clusterer->setMaxIters(_clustererMaxIters);
+        }
+        clusterer->setNumClusters(k);
+        clusterer->setEnforceNumClusters(enforceNumClusters);
+        return clusterer;
+    }
+
+    /**
+     * Returns a clusterer from borrowClusterer() to the pool once the results
+     * of its last cluster() are no longer used.
+     */
+    void returnClusterer(CLUSTERER* clusterer) {
+        _clusterers.push(clusterer);
+    }
 
     double RMSE() {
-        double RMSE = sumSquaredError(NULL, _root);
+        if (_root->getSumSquaredError() < 0) {
+            _root->setSumSquaredError(sumSquaredError(NULL, _root));
+        }
+        double RMSE = _root->getSumSquaredError();
         uint64_t size = getObjCount();
         RMSE /= size;
         RMSE = sqrt(RMSE);
@@ -191,37 +584,6 @@ private:
         return distance;
     }
 
-    uint64_t objCount(Node<T>* current) {
-        if (current->isLeaf()) {
-            return current->size();
-        } else {
-            uint64_t localCount = 0;
-            vector<Node<T>*>& children = current->getChildren();
-            for (Node<T> *child : children) {
-                localCount += objCount(child);
-
-            }
-            return localCount;
-        }
-    }
-
-    int clusterCount(Node<T>* current) {
-        if (current->isLeaf()) {
-            if (current->isEmpty()) {
-                return 0;
-            } else {
-                return 1;
-            }
-        } else {
-            int localCount = 0;
-            vector<Node<T>*>& children = current->getChildren();
-            for (Node<T> *child : children) {
-                localCount += clusterCount(child);
-            }
-            return localCount;
-        }
-    }
-
     int clusterCount(Node<T>* current, int depth) {
         if (depth == 1) {
             int localCount = 0;
@@ -279,6 +641,7 @@ private:
                 }
             }
             n->finalizeRemovals();
+            n->updateCounts();
             return pruned;
         }
     }
@@ -323,6 +686,7 @@ private:
                 result = splitLeafNode(n, vec);
             } else {
                 n->add(vec); // Finished
+                n->updateCounts();
             }
         } else { // It is an internal node.
             // recurse via nearest neighbour cluster
@@ -330,7 +694,9 @@ private:
             auto nearest = _optimizer.nearest(vec, keys);
             result = pushDown(n->getChild(nearest.index), vec);
             if (result.isSplit) {
-                updatePrototype(result._child1, result._key1);
+                // the first half keeps its place and key in n
+                delete result._key1;
+                updatePrototype(result._child1, n->getKey(nearest.index));
                 updatePrototype(result._child2, result._key2);
 
                 // add new node
@@ -347,6 +713,9 @@ private:
                     updatePrototype(n->getChild(nearest.index), n->getKey(nearest.index));
                 }
             }
+            // the counts of the insertion path are kept up to date so that
+            // prototype updates do not recount whole subtrees
+            n->updateCounts();
         }
         return result;
     }
@@ -366,11 +735,15 @@ private:
 
         // Copy child nodes into a temp storage vector
 
-        tempKeys = parent->getKeys();
+        vector<T*> tempKeys = parent->getKeys();
         tempKeys.push_back(obj);
 
-        tempChildren = parent->getChildren();
+        vector<Node<T>*> tempChildren = parent->getChildren();
         tempChildren.push_back(child);
+        unordered_map<T*, Node<T>*> childOf;
+        for (size_t i = 0; i < tempKeys.size(); ++i) {
+            childOf[tempKeys[i]] = tempChildren[i];
+        }
 
         // DetachRemove children from child node
         parent->clearKeysAndChildren();
@@ -383,18 +756,21 @@ private:
         vector<Cluster<T>*>& clusters = _clusterer.cluster(tempKeys);
         //std::cout << "clusters found = " << clusters.size() << std::flush;
 
-        // Get nearest centroids after clustering
+        // Get nearest centroids after clustering, moving each key with its
+        // child
         for (auto key : clusters[0]->getNearestList()) {
-            parent->add(key);
+            parent->add(key, childOf[key]);
         }
         for (auto key : clusters[1]->getNearestList()) {
-            node2->add(key);
+            node2->add(key, childOf[key]);
         }        
 
         // Now make our split result
         result.isSplit = true;
         result._child1 = parent;
         result._child2 = node2;
+        parent->updateCounts();
+        node2->updateCounts();
         result._key1 = clusters[0]->getCentroid();
         result._key2 = clusters[1]->getCentroid();
 
@@ -415,7 +791,7 @@ private:
 
         // Copy child nodes into a temp storage vector
 
-        tempKeys = child->getKeys();
+        vector<T*> tempKeys = child->getKeys();
         tempKeys.push_back(obj);
 
         // DetachRemove children from child node
@@ -441,6 +817,8 @@ private:
         result.isSplit = true;
         result._child1 = child;
         result._child2 = node2;
+        child->updateCounts();
+        node2->updateCounts();
         result._key1 = clusters[0]->getCentroid();
         result._key2 = clusters[1]->getCentroid();
 
@@ -454,13 +832,13 @@ private:
         //cout << "\nUpdating mean ...";
 
         //int[] weights = new int[count];
-        weights.clear();
+        vector<int> weights;
 
         if (!child->isLeaf()) {
             vector<Node<T>*>& children = child->getChildren();
 
             for (size_t i = 0; i < children.size(); i++) {
-                weights.push_back(objCount(children[i]));
+                weights.push_back(children[i]->getObjCount());
             }
         }
 
@@ -490,19 +868,22 @@ private:
 
     OPTIMIZER _optimizer;
 
-    // Use these containers so as not to create new ones
-    // every time we split
-    vector<T*> tempKeys;
-    vector<Node<T>*> tempChildren;
-    vector<size_t> tempNearCentroids;
+    int _clustererMaxIters;
 
-    vector<T*> removed;
+    // Clusterers not borrowed by add(vector<T*>&) or bulkLoad()
+    tbb::concurrent_queue<CLUSTERER*> _clusterers;
 
-    // Weights for prototype function (we don't have to use these)
-    vector<int> weights;
+    // Prototypes of each thread in add(vector<T*>&)
+    tbb::enumerable_thread_specific<T*> _localPrototypes;
+
+    // Leaves being split by add(vector<T*>&)
+    unordered_set<Node<T>*> _splitting;
+    tbb::spin_mutex _splittingMutex;
+
+    vector<T*> removed;
 
     // How many vectors have been inserted into the tree.
-    size_t _added;
+    atomic<size_t> _added;
 
     // Use delayed updates?
     bool _delayedUpdates;
@@ -0,0 +1,125 @@
+#ifndef KEYMATRIX_H
+#define	KEYMATRIX_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace lmw {
+
+/**
+ * A KeyMatrix packs the bit vector keys of a node into one contiguous block
+ * of memory aligned to a cache line. Each row is padded to a whole number of
+ * cache lines, so a nearest neighbor search over the keys of a node streams
+ * through memory in order and hardware prefetching hides most of the latency.
+ * Without it every SVector<bool> key is a separate heap allocation.
+ *
+ * A KeyMatrix is a snapshot of the keys. It must be rebuilt when keys change.
+ */
+class KeyMatrix {
+public:
+    KeyMatrix(const size_t rows, const size_t numBlocks) : _numBlocks(numBlocks),
+            _stride(((numBlocks + blocksPerLine - 1) / blocksPerLine) * blocksPerLine),
+            _data(NULL), _rows(rows) {
+        void* data = NULL;
+        size_t bytes = std::max(rows * _stride, size_t(1)) * sizeof(uint64_t);
+        if (posix_memalign(&data, cacheLineSize, bytes) != 0) {
+            throw std::bad_alloc();
+        }
+        _data = static_cast<uint64_t*>(data);
+        memset(_data, 0, bytes);
+        for (size_t i = 0; i < rows; ++i) {
+            _rows[i] = _data + i * _stride;
+        }
+    }
+
+    ~KeyMatrix() {
+        free(_data);
+    }
+
+    size_t size() const {
+        return _rows.size();
+    }
+
+    size_t getNumBlocks() const {
+        return _numBlocks;
+    }
+
+    /**
+     * The blocks in each row including its zeroed padding.
+     */
+    size_t getNumPaddedBlocks() const {
+        return _stride;
+    }
+
+    const uint64_t* getRow(const size_t i) const {
+        return _rows[i];
+    }
+
+    /**
+     * Pointers to all rows in order. This is the layout expected by the
+     * one-to-many kernels in HammingKernels.h.
+     */
+    const uint64_t* const* getRows() const {
+        return _rows.data();
+    }
+
+    void setRow(const size_t i, const SVector<bool>& key) {
+        memcpy(_data + i * _stride, key.getData(), _numBlocks * sizeof(uint64_t));
+    }
+
+private:
+    KeyMatrix(const KeyMatrix&);
+    KeyMatrix& operator=(const KeyMatrix&);
+
+    static const size_t cacheLineSize = 64;
+    static const size_t blocksPerLine = cacheLineSize / sizeof(uint64_t);
+
+    size_t _numBlocks; // blocks in each key
+    size_t _stride; // blocks between the start of consecutive rows
+    uint64_t* _data;
+    vector<const uint64_t*> _rows;
+};
+
+/**
+ * KeyPacker builds a KeyMatrix from the keys of a node. ACCESSOR returns the
+ * T* for each key as in Optimizer::nearest. Only bit vectors can be packed,
+ * for other types pack() returns NULL and searches use the keys directly.
+ */
+template <typename T>
+struct KeyPacker {
+    static KeyMatrix* pack(const vector<T*>& keys) {
+        return NULL;
+    }
+
+    template <typename KEY, typename ACCESSOR>
+    static KeyMatrix* pack(const vector<KEY*>& keys, const ACCESSOR& accessor) {
+        return NULL;
+    }
+};
+
+template <>
+struct KeyPacker<SVector<bool>> {
+    static KeyMatrix* pack(const vector<SVector<bool>*>& keys) {
+        return pack(keys, [](const SVector<bool>* key) { return key; });
+    }
+
+    template <typename KEY, typename ACCESSOR>
+    static KeyMatrix* pack(const vector<KEY*>& keys, const ACCESSOR& accessor) {
+        if (keys.empty()) {
+            return NULL;
+        }
+        KeyMatrix* matrix = new KeyMatrix(keys.size(),
+                accessor(keys[0])->getNumBlocks());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            matrix->setRow(i, *accessor(keys[i]));
+        }
+        return matrix;
+    }
+};
+
+} // namespace lmw
+
+#endif	/* KEYMATRIX_H */
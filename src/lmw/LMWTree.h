@@ -0,0 +1,76 @@
+/**
+ * LMWTree.h is the interface of the lmw library. It includes the clustering
+ * engines and names the bit vector types that the library instantiates.
+ *
+ * The engines are templates, so every program that includes them compiles
+ * them again. The lmw library explicitly instantiates the types below once
+ * (see Instantiations.cpp), and they are declared extern here so programs
+ * that include this header and link against the library do not. Other
+ * instantiations of the templates still work as before.
+ *
+ * For example,
+ *      #include "lmw/LMWTree.h"
+ *      lmw::BitKMeans kmeans(10);
+ *      vector<lmw::Cluster<lmw::BitVector>*>& clusters = kmeans.cluster(vectors);
+ * and link with -llmw -ltbb.
+ */
+
+#ifndef LMWTREE_H
+#define	LMWTREE_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+#include "Distance.h"
+#include "Prototype.h"
+#include "Optimizer.h"
+#include "RandomSeeder.h"
+#include "BitSlicedAccumulator.h"
+#include "SVectorStream.h"
+#include "SignatureFile.h"
+#include "PartitionedSignatureStream.h"
+#include "KMeans.h"
+#include "TSVQ.h"
+#include "EMTree.h"
+#include "StreamingEMTree.h"
+
+namespace lmw {
+
+typedef SVector<bool> BitVector;
+typedef Optimizer<BitVector, hammingDistance, Minimize, meanBitPrototype2> BitOptimizer;
+typedef RandomSeeder<BitVector> BitRandomSeeder;
+typedef KMeans<BitVector, BitRandomSeeder, BitOptimizer> BitKMeans;
+typedef TSVQ<BitVector, BitKMeans, hammingDistance> BitTSVQ;
+typedef EMTree<BitVector, BitKMeans, BitOptimizer> BitEMTree;
+typedef StreamingEMTree<BitVector, BitSlicedAccumulator, BitOptimizer> BitStreamingEMTree;
+typedef SVectorStream<BitVector> BitVectorStream;
+
+// Instantiations.cpp defines LMW_INSTANTIATE so these become the
+// definitions rather than extern declarations.
+#ifdef LMW_INSTANTIATE
+#define LMW_TEMPLATE template
+#else
+#define LMW_TEMPLATE extern template
+#endif
+
+LMW_TEMPLATE class KMeans<BitVector, BitRandomSeeder, BitOptimizer>;
+LMW_TEMPLATE class TSVQ<BitVector, BitKMeans, hammingDistance>;
+LMW_TEMPLATE class EMTree<BitVector, BitKMeans, BitOptimizer>;
+LMW_TEMPLATE class StreamingEMTree<BitVector, BitSlicedAccumulator, BitOptimizer>;
+
+// StreamingEMTree reads streams through member templates, which are only
+// instantiated for the streams named here.
+#define LMW_STREAM_TEMPLATES(STREAM) \
+    LMW_TEMPLATE size_t BitStreamingEMTree::insert<STREAM>(STREAM&); \
+    LMW_TEMPLATE size_t BitStreamingEMTree::insert<STREAM>(STREAM&, const size_t); \
+    LMW_TEMPLATE size_t BitStreamingEMTree::visit<STREAM>(STREAM&, InsertVisitor<BitVector>&);
+
+LMW_STREAM_TEMPLATES(BitVectorStream)
+LMW_STREAM_TEMPLATES(SignatureFileStream)
+LMW_STREAM_TEMPLATES(PartitionedSignatureStream)
+
+#undef LMW_STREAM_TEMPLATES
+#undef LMW_TEMPLATE
+
+} // namespace lmw
+
+#endif	/* LMWTREE_H */
@@ -0,0 +1,72 @@
+#ifndef MAPPEDFILE_H
+#define	MAPPEDFILE_H
+
+#include "StdIncludes.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lmw {
+
+/**
+ * A MappedFile maps a whole file into memory for as long as it exists.
+ *
+ * The mapping is read only and shared, so its pages are backed by the page
+ * cache and do not count against the memory the kernel will commit. Files
+ * much larger than memory can be mapped, and writing through a pointer into
+ * the mapping faults rather than modifying the file. The kernel is told the
+ * file will be read sequentially so it reads ahead aggressively and drops
+ * pages that have been passed.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const string& filename) : _data(NULL), _size(0) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw runtime_error("failed to open " + filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            close(fd);
+            throw runtime_error("failed to stat " + filename);
+        }
+        _size = st.st_size;
+        if (_size > 0) {
+            void* data = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw runtime_error("failed to mmap " + filename);
+            }
+            _data = static_cast<char*>(data);
+            madvise(_data, _size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (_data) {
+            munmap(_data, _size);
+        }
+    }
+
+    const char* data() const {
+        return _data;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    char* _data; // mapped read only
+    size_t _size;
+};
+
+} // namespace lmw
+
+#endif	/* MAPPEDFILE_H */
@@ -0,0 +1,147 @@
+#ifndef MAPPEDSVECTORSTREAM_H
+#define	MAPPEDSVECTORSTREAM_H
+
+#include "StdIncludes.h"
+#include "MappedFile.h"
+#include "SVector.h"
+
+#include <cstring>
+
+namespace lmw {
+
+/**
+ * Allocates uninitialized space for n SVector<bool> views with a single
+ * allocation. Views are constructed in place with placement new and are
+ * released together by destroyViews().
+ */
+inline SVector<bool>* allocateViews(const size_t n) {
+    return static_cast<SVector<bool>*>(::operator new(n * sizeof(SVector<bool>)));
+}
+
+/**
+ * Destroys the first n views in space returned by allocateViews() and frees
+ * the space.
+ */
+inline void destroyViews(SVector<bool>* views, const size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        views[i].~SVector<bool>();
+    }
+    ::operator delete(views);
+}
+
+/**
+ * A MappedSVectorStream reads the same files as SVectorStream<SVector<bool>>
+ * but maps them into memory rather than copying each signature. The vectors
+ * it returns are read only views directly into the mapped signature file and
+ * their IDs are only copied out of the mapped ID file when getID() is called.
+ * The files are mapped read only, so they may be larger than memory.
+ *
+ * IDs are found by scanning the mapped ID file for the next newline as the
+ * stream advances, which touches each byte once. The stream keeps no offset
+ * index of the lines, because one would take 8 bytes per vector, several
+ * gigabytes for ClueWeb, and a sequential stream never needs to look an ID up
+ * out of order. For random access and seeking, convert the files to a
+ * SignatureFile, which stores an ID offset index on disk.
+ *
+ * A call to read() makes a single allocation holding all the views it
+ * returns, and free() releases it. The vectors must not be used after free()
+ * or after the stream has been destroyed.
+ *
+ * It follows the VectorStream concept in SVectorStream.h, so it can be passed
+ * to StreamingEMTree::insert() and StreamingEMTree::visit().
+ *
+ * For example,
+ *      MappedSVectorStream vs(idFile, signatureFile, 4096);
+ *      emtree.insert(vs);
+ */
+class MappedSVectorStream {
+public:
+    /**
+     * @param idFile An ASCII file with one object ID per line.
+     * @param signatureFile A file of binary signatures containing as many
+     *                      signatures as there are lines in idFile.
+     * @param signatureLength The length of a signature in bits.
+     */
+    MappedSVectorStream(const string& idFile, const string& signatureFile,
+            const size_t signatureLength)
+            : MappedSVectorStream(idFile, signatureFile, signatureLength, -1) { }
+
+    /**
+     * @param idFile An ASCII file with one object ID per line.
+     * @param signatureFile A file of binary signatures containing as many
+     *                      signatures as there are lines in idFile.
+     * @param signatureLength The length of a signature in bits.
+     * @param maxToRead The maximum number of vectors to read. A value of -1
+     *                  indicates to read all.
+     */
+    MappedSVectorStream(const string& idFile, const string& signatureFile,
+            const size_t signatureLength, const size_t maxToRead)
+            : _ids(idFile),
+            _signatures(signatureFile),
+            _signatureLength(signatureLength),
+            _signatureBytes(signatureLength / 8),
+            _maxToRead(maxToRead),
+            _count(0),
+            _idOffset(0) {
+        if (signatureLength % 64 != 0) {
+            throw runtime_error("length is not divisible by 64");
+        }
+        if (_signatures.size() % _signatureBytes != 0) {
+            throw runtime_error(signatureFile + " does not contain a whole "
+                    "number of signatures");
+        }
+        _numSignatures = _signatures.size() / _signatureBytes;
+    }
+
+    size_t read(size_t n, vector<SVector<bool>*>* data) {
+        size_t available = _numSignatures - _count;
+        if (_maxToRead != -1) {
+            available = std::min(available, _maxToRead - std::min(_count, _maxToRead));
+        }
+        n = std::min(n, available);
+        if (n == 0) {
+            return 0;
+        }
+        SVector<bool>* views = allocateViews(n);
+        for (size_t i = 0; i < n; ++i) {
+            const char* id = _ids.data() + _idOffset;
+            size_t remaining = _ids.size() - _idOffset;
+            if (remaining == 0) {
+                destroyViews(views, i);
+                throw runtime_error("fewer IDs than signatures");
+            }
+            const char* end = static_cast<const char*>(memchr(id, '\n', remaining));
+            size_t idLength = end ? end - id : remaining;
+            _idOffset += end ? idLength + 1 : idLength;
+            const block_type* signature = reinterpret_cast<const block_type*>(
+                    _signatures.data() + (_count + i) * _signatureBytes);
+            data->push_back(new (&views[i]) SVector<bool>(signature,
+                    _signatureLength, id, idLength));
+        }
+        _count += n;
+        return n;
+    }
+
+    /**
+     * data must be exactly as returned by read().
+     */
+    void free(vector<SVector<bool>*>* data) {
+        if (!data->empty()) {
+            destroyViews(data->front(), data->size());
+        }
+    }
+
+private:
+    MappedFile _ids;
+    MappedFile _signatures;
+    size_t _signatureLength; // the length of signatures in bits
+    size_t _signatureBytes;
+    size_t _numSignatures;
+    size_t _maxToRead;
+    size_t _count; // Number of vectors read so far
+    size_t _idOffset; // offset of the next ID in _ids
+};
+
+} // namespace lmw
+
+#endif	/* MAPPEDSVECTORSTREAM_H */
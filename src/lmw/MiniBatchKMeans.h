@@ -0,0 +1,258 @@
+#ifndef MINIBATCHKMEANS_H
+#define	MINIBATCHKMEANS_H
+
+#include "Accumulator.h"
+#include "Cluster.h"
+#include "Clusterer.h"
+#include "Seeder.h"
+#include "StdIncludes.h"
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
+namespace lmw {
+
+/**
+ * MiniBatchKMeans is k-means where each iteration only looks at a small
+ * random sample of the data (Sculley, Web-Scale K-Means Clustering, 2010).
+ * The vectors in a batch are assigned to their nearest centroid, and each
+ * centroid then takes a step towards its vectors with its own learning rate
+ * of 1 / (number of vectors it has been given so far).
+ *
+ * With that learning rate a centroid is the running mean of every vector it
+ * has been given. For bit vectors the mean is rounded to the nearest bit,
+ * which is the per-dimension median, so the centroid is kept as a sum in an
+ * accumulator and recalculated with the OPTIMIZER's prototype_reduction
+ * (see Prototype.h), which must be enabled. The step is exact rather than
+ * a floating point approximation.
+ *
+ * After the last batch all vectors are assigned to their nearest centroid
+ * once, so the clusters returned are the same as from KMeans and it can be
+ * used as the CLUSTERER for TSVQ, KTree and EMTree.
+ *
+ * The cost is maxIters * batchSize distance searches and one pass over the
+ * data, no matter how much data there is.
+ *
+ * For example,
+ *      MiniBatchKMeans<SVector<bool>, RandomSeeder<SVector<bool>>, OPTIMIZER> clusterer(100);
+ *      clusterer.setBatchSize(1000);
+ *      clusterer.setMaxIters(100);
+ *      vector<Cluster<SVector<bool>>*>& clusters = clusterer.cluster(vectors);
+ */
+template <typename T, typename SEEDER, typename OPTIMIZER>
+class MiniBatchKMeans : public Clusterer<T> {
+public:
+    typedef typename OPTIMIZER::prototype_reduction PrototypeReduction;
+
+    typedef typename PrototypeReduction::Accumulator Accumulator;
+
+    static_assert(PrototypeReduction::enabled,
+            "MiniBatchKMeans needs an OPTIMIZER with an enabled prototype_reduction");
+
+    MiniBatchKMeans(int numClusters) : _numClusters(numClusters) {
+    }
+
+    ~MiniBatchKMeans() {
+        Utils::purge(_clusters);
+        Utils::purge(_sums);
+    }
+
+    void setNumClusters(size_t numClusters) {
+        _numClusters = numClusters;
+    }
+
+    /**
+     * The number of mini-batches. 0 only assigns vectors to the seeds.
+     */
+    void setMaxIters(int maxIters) {
+        _maxIters = maxIters;
+    }
+
+    /**
+     * The number of vectors sampled for each mini-batch. When there are fewer
+     * vectors than that, every batch is all of them.
+     */
+    void setBatchSize(size_t batchSize) {
+        _batchSize = batchSize;
+    }
+
+    void setEnforceNumClusters(bool enforceNumClusters) {
+        _enforceNumClusters = enforceNumClusters;
+    }
+
+    int numClusters() {
+        return _numClusters;
+    }
+
+    vector<Cluster<T>*>& cluster(vector<T*> &data) {
+        Utils::purge(_clusters);
+        _clusters.clear();
+        _finalClusters.clear();
+        _centroids.clear();
+        _seeder.seed(data, _centroids, _numClusters);
+        for (T* c : _centroids) {
+            _clusters.push_back(new Cluster<T>(c));
+        }
+        resetSums();
+        for (int i = 0; i < _maxIters; i++) {
+            miniBatch(data);
+        }
+        vectorsToNearestCentroid(data);
+        finalizeClusters(data);
+        return _finalClusters;
+    }
+
+    /**
+     * pre: cluster() has been called
+     */
+    double getRMSE() {
+        double SSE = 0;
+        size_t objects = 0;
+        for (Cluster<T>* cluster : _finalClusters) {
+            auto& neighbours = cluster->getNearestList();
+            objects += neighbours.size();
+            SSE += _optimizer.sumSquaredError(cluster->getCentroid(), neighbours);
+        }
+        return sqrt(SSE / objects);
+    }
+
+private:
+    void resetSums() {
+        Utils::purge(_sums);
+        _sums.clear();
+        _counts.assign(_centroids.size(), 0);
+        const size_t dimensions = _centroids.empty() ? 0 : _centroids[0]->size();
+        for (size_t j = 0; j < _centroids.size(); j++) {
+            _sums.push_back(new Accumulator(dimensions));
+            _sums.back()->setAll(0);
+        }
+    }
+
+    /**
+     * Samples a batch, finds the nearest centroid for each of its vectors in
+     * parallel and then updates each centroid that was given vectors in
+     * parallel.
+     */
+    void miniBatch(vector<T*> &data) {
+        if (data.empty()) {
+            return;
+        }
+        const size_t batchSize = std::min(_batchSize, data.size());
+        vector<T*> batch(batchSize);
+        if (batchSize == data.size()) {
+            batch = data;
+        } else {
+            for (size_t i = 0; i < batchSize; i++) {
+                batch[i] = data[std::rand() % data.size()];
+            }
+        }
+        vector<size_t> nearest(batchSize);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, batchSize, 100),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        nearest[i] = _optimizer.nearest(batch[i], _centroids).index;
+                    }
+                }
+        );
+        vector<vector<T*>> given(_centroids.size());
+        for (size_t i = 0; i < batchSize; i++) {
+            given[nearest[i]].push_back(batch[i]);
+        }
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, _centroids.size()),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t j = r.begin(); j != r.end(); ++j) {
+                        if (given[j].empty()) {
+                            continue;
+                        }
+                        for (T* vector : given[j]) {
+                            accumulate(*_sums[j], *vector);
+                        }
+                        _counts[j] += given[j].size();
+                        PrototypeReduction::prototype(_centroids[j], *_sums[j], _counts[j]);
+                    }
+                }
+        );
+    }
+
+    void vectorsToNearestCentroid(vector<T*> &data) {
+        _nearestCentroid.resize(data.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        _nearestCentroid[i] = _optimizer.nearest(data[i], _centroids).index;
+                    }
+                }
+        );
+        for (Cluster<T>* c : _clusters) {
+            c->clearNearest();
+        }
+        for (size_t i = 0; i < data.size(); i++) {
+            _clusters[_nearestCentroid[i]]->addNearest(data[i]);
+        }
+    }
+
+    /**
+     * Returns the non-empty clusters. The centroids of empty clusters are
+     * deleted because nobody else will see them. If the number of clusters
+     * is enforced and some are empty, the vectors are dealt out to all
+     * clusters in random order instead and the centroids recalculated.
+     */
+    void finalizeClusters(vector<T*> &data) {
+        bool emptyCluster = false;
+        for (Cluster<T>* c : _clusters) {
+            emptyCluster |= c->getNearestList().empty();
+        }
+        if (emptyCluster && _enforceNumClusters && data.size() >= _clusters.size()) {
+            vector<T*> shuffled(data);
+            std::random_shuffle(shuffled.begin(), shuffled.end());
+            for (Cluster<T>* c : _clusters) {
+                c->clearNearest();
+            }
+            for (size_t i = 0; i < shuffled.size(); i++) {
+                _clusters[i % _clusters.size()]->addNearest(shuffled[i]);
+            }
+            for (Cluster<T>* c : _clusters) {
+                _optimizer.updatePrototype(c->getCentroid(), c->getNearestList(), _weights);
+            }
+        }
+        for (Cluster<T>* c : _clusters) {
+            if (!c->getNearestList().empty()) {
+                _finalClusters.push_back(c);
+            } else {
+                delete c->getCentroid();
+            }
+        }
+    }
+
+    SEEDER _seeder;
+    OPTIMIZER _optimizer;
+
+    // enforce the number of clusters required
+    bool _enforceNumClusters = false;
+
+    // number of mini-batches
+    int _maxIters = 100;
+
+    // vectors sampled for each mini-batch
+    size_t _batchSize = 1000;
+
+    // How many clusters should be found? i.e. k
+    int _numClusters = 0;
+
+    vector<T*> _centroids;
+    vector<Cluster<T>*> _clusters;
+    vector<Cluster<T>*> _finalClusters;
+
+    // The sum of all vectors given to each centroid and how many there were.
+    vector<Accumulator*> _sums;
+    vector<uint64_t> _counts;
+
+    // The centroid index for each vector after the last batch.
+    vector<size_t> _nearestCentroid;
+
+    // Empty weights for the prototype function.
+    vector<int> _weights;
+};
+
+} // namespace lmw
+
+#endif	/* MINIBATCHKMEANS_H */
@@ -2,18 +2,22 @@
 #define NODE_H
 
 #include "StdIncludes.h"
+#include "KeyMatrix.h"
+#include "tbb/spin_rw_mutex.h"
 
 namespace lmw {
 
 template <typename T>
 class Node {
 public:
-    Node() : _isLeaf(true), _ownsKeys(false) { }
+    Node() : _isLeaf(true), _ownsKeys(false), _keyMatrix(NULL), _objCount(0),
+        _clusterCount(0), _sumSquaredError(-1) { }
 
     ~Node() {
         for (size_t i = 0; i < size(); i++) {
             remove(i);
         }
+        delete _keyMatrix;
     }
 
     bool isEmpty() const {
@@ -36,6 +40,89 @@ public:
         _ownsKeys = ownsKeys;
     }
 
+    /**
+     * The number of data vectors in the subtree rooted at this node as of
+     * the last updateCounts(). Adding or removing keys does not change it.
+     */
+    uint64_t getObjCount() const {
+        return _objCount;
+    }
+
+    /**
+     * The number of non-empty leaves in the subtree rooted at this node as of
+     * the last updateCounts().
+     */
+    int getClusterCount() const {
+        return _clusterCount;
+    }
+
+    /**
+     * Adds to the counts of this node, for example when a vector is inserted
+     * into the subtree concurrently and the node cannot be recounted from its
+     * children. It is thread safe.
+     */
+    void addCounts(const uint64_t objCount, const int clusterCount) {
+        _objCount += objCount;
+        _clusterCount += clusterCount;
+    }
+
+    /**
+     * The sum of squared errors of the subtree rooted at this node as cached
+     * by the tree that owns it, or -1 if it is not known. Trees cache it in
+     * their root because calculating it visits every vector, and set it to
+     * -1 whenever they change.
+     */
+    double getSumSquaredError() const {
+        return _sumSquaredError;
+    }
+
+    void setSumSquaredError(const double sumSquaredError) {
+        _sumSquaredError = sumSquaredError;
+    }
+
+    /**
+     * Recounts a leaf from its keys or an internal node from the counts of
+     * its children, so a tree is recounted by updating the nodes that changed
+     * from the bottom up.
+     */
+    void updateCounts() {
+        if (_isLeaf) {
+            _objCount = _keys.size();
+            _clusterCount = _keys.empty() ? 0 : 1;
+        } else {
+            _objCount = 0;
+            _clusterCount = 0;
+            for (Node* child : _children) {
+                _objCount += child->_objCount;
+                _clusterCount += child->_clusterCount;
+            }
+        }
+    }
+
+    /**
+     * Recounts every node in the subtree rooted at this node, children first.
+     */
+    void updateCountsRecursively() {
+        if (!_isLeaf) {
+            for (Node* child : _children) {
+                child->updateCountsRecursively();
+            }
+        }
+        updateCounts();
+    }
+
+    typedef tbb::spin_rw_mutex Latch;
+
+    /**
+     * The latch is not used by the node itself. Trees that update nodes from
+     * many threads at once, such as KTree::add(vector<T*>&), take it shared
+     * to read the keys and children of the node and exclusive to change them.
+     * Latches are always taken from the parent down to the child.
+     */
+    Latch& getLatch() {
+        return _latch;
+    }
+
     T* getKey(const int i) {
         return _keys[i];
     }
@@ -52,6 +139,24 @@ public:
         return _keys;
     }
 
+    /**
+     * The keys packed into contiguous memory for nearest neighbor search, or
+     * NULL if the keys have not been packed. Adding or removing keys discards
+     * the matrix. Keys updated in place must be packed again with
+     * setKeyMatrix().
+     */
+    const KeyMatrix* getKeyMatrix() const {
+        return _keyMatrix;
+    }
+
+    /**
+     * The node takes ownership of keyMatrix. It may be NULL.
+     */
+    void setKeyMatrix(KeyMatrix* keyMatrix) {
+        delete _keyMatrix;
+        _keyMatrix = keyMatrix;
+    }
+
     /**
      * pre: !isLeaf()
      */
@@ -75,6 +180,7 @@ public:
     }
 
     void clearKeysAndChildren() {
+        setKeyMatrix(NULL);
         _children.clear();
         _keys.clear();
     }
@@ -83,21 +189,25 @@ public:
      * pre: isLeaf()
      */
     void add(T* key) {
+        setKeyMatrix(NULL);
         _keys.push_back(key);
     }
 
     void add(T* key, Node *node) {
+        setKeyMatrix(NULL);
         _keys.push_back(key);
         _children.push_back(node);
         _isLeaf = false;
     }
 
     void addAll(vector<T*> &keys) {
+        setKeyMatrix(NULL);
         _keys = keys;
     }
 
     void removeData(vector<T*>& data) {
         if (isLeaf()) {
+            setKeyMatrix(NULL);
             for (int i = 0; i < _keys.size(); i++) {
                 data.push_back(_keys[i]);
             }
@@ -106,6 +216,7 @@ public:
     }
 
     void removeData(vector<T*>& keys, vector<Node<T>*>& children) {
+        setKeyMatrix(NULL);
         std::copy(_keys.begin(), _keys.end(), std::back_inserter(keys));
         _keys.clear();
         std::copy(_children.begin(), _children.end(), std::back_inserter(children));
@@ -151,6 +262,7 @@ public:
         // Resize vector containers
         int newSize = sz - toRemove;
         if (toRemove > 0) {
+            setKeyMatrix(NULL);
             _keys.resize(newSize);
             if (!_isLeaf) {
                 _children.resize(newSize);
@@ -170,6 +282,19 @@ private:
 
     // Will the keys be deleted?
     bool _ownsKeys;
+
+    // Optional contiguous copy of the keys for nearest neighbor search.
+    KeyMatrix* _keyMatrix;
+
+    // Data vectors and non-empty leaves in this subtree as of the last
+    // updateCounts().
+    atomic<uint64_t> _objCount;
+    atomic<int> _clusterCount;
+
+    // See getSumSquaredError().
+    double _sumSquaredError;
+
+    Latch _latch;
 };
 
 } // namespace lmw
@@ -16,6 +16,10 @@
 #define	OPTIMIZER_H
 
 #include "StdIncludes.h"
+#include "Distance.h"
+#include "KeyMatrix.h"
+#include "Prototype.h"
+#include "SVector.h"
 
 namespace lmw {
 
@@ -38,9 +42,100 @@ struct Nearest {
     double distance;
 };
 
+/**
+ * NearestSearch finds the key nearest to an object. The general version calls
+ * DISTANCE once per key. Specializations can search all keys of a node in one
+ * batched kernel call, and can use a KeyMatrix holding the same keys packed
+ * into contiguous memory. The general version ignores the KeyMatrix.
+ */
+template <typename T, typename DISTANCE, typename COMPARATOR>
+struct NearestSearch {
+    template <typename KEY, typename ACCESSOR>
+    static Nearest<KEY> nearest(const DISTANCE& distance,
+            const COMPARATOR& comp, const T* object,
+            const vector<KEY*>& others, const ACCESSOR& accessor,
+            const KeyMatrix* matrix) {
+        return nearest(distance, comp, object, others, accessor);
+    }
+
+    template <typename KEY, typename ACCESSOR>
+    static Nearest<KEY> nearest(const DISTANCE& distance,
+            const COMPARATOR& comp, const T* object,
+            const vector<KEY*>& others, const ACCESSOR& accessor) {
+        size_t nearestIndex = 0;
+        double nearestDistance = distance(object, accessor(others[0]));
+        for (size_t i = 1; i < others.size(); ++i) {
+            double currentDistance = distance(object, accessor(others[i]));
+            if (comp(currentDistance, nearestDistance)) {
+                nearestDistance = currentDistance;
+                nearestIndex = i;
+            }
+        }
+        return {others[nearestIndex], nearestIndex, nearestDistance};
+    }
+};
+
+/**
+ * Minimizing Hamming distance uses the one-to-many kernel from
+ * HammingKernels.h. The query stays in registers or L1 while the keys are
+ * streamed past it, and the argmin is found inside the kernel. Key pointers
+ * are gathered on the stack in chunks so no allocation is needed.
+ */
+template <>
+struct NearestSearch<SVector<bool>, hammingDistance, Minimize> {
+    template <typename KEY, typename ACCESSOR>
+    static Nearest<KEY> nearest(const hammingDistance& distance,
+            const Minimize& comp, const SVector<bool>* object,
+            const vector<KEY*>& others, const ACCESSOR& accessor,
+            const KeyMatrix* matrix) {
+        if (!matrix) {
+            return nearest(distance, comp, object, others, accessor);
+        }
+        // both are padded with zeros when the object owns its blocks
+        int nearestDistance;
+        size_t nearestIndex = HammingKernels::nearest(object->getData(),
+                matrix->getRows(), matrix->size(),
+                HammingKernels::blocks(
+                std::min(object->getNumBlocks(), matrix->getNumBlocks()),
+                std::min(object->getNumPaddedBlocks(), matrix->getNumPaddedBlocks())),
+                &nearestDistance);
+        return {others[nearestIndex], nearestIndex, double(nearestDistance)};
+    }
+
+    template <typename KEY, typename ACCESSOR>
+    static Nearest<KEY> nearest(const hammingDistance& distance,
+            const Minimize& comp, const SVector<bool>* object,
+            const vector<KEY*>& others, const ACCESSOR& accessor) {
+        const size_t chunkSize = 256;
+        const uint64_t* keys[chunkSize];
+        const HammingKernel& kernel = HammingKernels::best();
+        const size_t numBlocks = object->getNumBlocks();
+        size_t nearestIndex = 0;
+        int nearestDistance = std::numeric_limits<int>::max();
+        for (size_t start = 0; start < others.size(); start += chunkSize) {
+            const size_t count = std::min(chunkSize, others.size() - start);
+            for (size_t i = 0; i < count; ++i) {
+                keys[i] = accessor(others[start + i])->getData();
+            }
+            int chunkDistance;
+            size_t chunkIndex = kernel.nearest(object->getData(), keys, count,
+                    numBlocks, &chunkDistance);
+            if (chunkDistance < nearestDistance) {
+                nearestDistance = chunkDistance;
+                nearestIndex = start + chunkIndex;
+            }
+        }
+        return {others[nearestIndex], nearestIndex, double(nearestDistance)};
+    }
+};
+
 template <typename T, typename DISTANCE, typename COMPARATOR, typename PROTOTYPE>
 class Optimizer {
 public:
+    /**
+     * Calculates the prototype from a sum when enabled (see Prototype.h).
+     */
+    typedef PrototypeReduction<T, PROTOTYPE> prototype_reduction;
 
     void updatePrototype(T* prototype, const vector<T*>& neighbours,
             const vector<int>& weights) const {
@@ -65,6 +160,28 @@ public:
         return nearestAccessor(object, others, accessor);
     }
 
+    /**
+     * As above, but matrix may hold the same keys as others packed into
+     * contiguous memory (see Node::getKeyMatrix()). It is used when the
+     * DISTANCE supports it and is not NULL.
+     */
+    Nearest<T> nearest(const T* object, const vector<T*>& others,
+            const KeyMatrix* matrix) const {
+        return NearestSearch<T, DISTANCE, COMPARATOR>::nearest(_distance, _comp,
+                object, others, _defaultAccessor, matrix);
+    }
+
+    template <typename KEY, typename ACCESSOR>
+    Nearest<KEY> nearest(const T* object, const vector<KEY*>& others,
+            const ACCESSOR& accessor, const KeyMatrix* matrix) const {
+        return NearestSearch<T, DISTANCE, COMPARATOR>::nearest(_distance, _comp,
+                object, others, accessor, matrix);
+    }
+
+    double distance(const T* object1, const T* object2) const {
+        return _distance(object1, object2);
+    }
+
     double squaredDistance(const T* object1, const T* object2) const {
         return _distance.squared(object1, object2);
     }
@@ -91,16 +208,8 @@ private:
     template <typename KEY, typename ACCESSOR>
     Nearest<KEY> nearestAccessor(const T* object, const vector<KEY*>& others,
             const ACCESSOR& accessor) const {
-        size_t nearestIndex = 0;
-        double nearestDistance = _distance(object, accessor(others[0]));
-        for (size_t i = 1; i < others.size(); ++i) {
-            double currentDistance = _distance(object, accessor(others[i]));
-            if (_comp(currentDistance, nearestDistance)) {
-                nearestDistance = currentDistance;
-                nearestIndex = i;
-            }
-        }
-        return {others[nearestIndex], nearestIndex, nearestDistance};
+        return NearestSearch<T, DISTANCE, COMPARATOR>::nearest(_distance, _comp,
+                object, others, accessor);
     }
 
     COMPARATOR _comp;
@@ -0,0 +1,107 @@
+#ifndef PARTITIONEDSIGNATURESTREAM_H
+#define	PARTITIONEDSIGNATURESTREAM_H
+
+#include "StdIncludes.h"
+#include "SignatureFile.h"
+#include "SVectorStream.h"
+
+namespace lmw {
+
+/**
+ * A PartitionedSignatureStream reads one or more signature files (see
+ * SignatureFile.h) from many threads at once.
+ *
+ * The signatures of all files are numbered in order. Each call to read()
+ * atomically claims the next n of them, which is the next byte range of the
+ * signature blocks, and creates views of them. No lock is held and nothing is
+ * copied, so the time spent in read() by each thread is small and
+ * StreamingEMTree reads it with a parallel input filter. A claim may span the
+ * end of one file and the start of the next.
+ *
+ * Because claims are handed out in order but may be completed out of order,
+ * vectors are not returned in file order when there are many readers.
+ *
+ * Each file is mapped read only by its SignatureFile, so the files together
+ * may be much larger than memory. The vectors are read only views.
+ *
+ * For example,
+ *      vector<string> files = {"part0.lmwsig", "part1.lmwsig"};
+ *      PartitionedSignatureStream vs(files);
+ *      emtree.insert(vs);
+ */
+class PartitionedSignatureStream {
+public:
+    explicit PartitionedSignatureStream(const string& filename)
+            : PartitionedSignatureStream(vector<string>(1, filename)) { }
+
+    explicit PartitionedSignatureStream(const vector<string>& filenames)
+            : _next(0) {
+        if (filenames.empty()) {
+            throw runtime_error("no signature files to read");
+        }
+        _offsets.push_back(0);
+        for (const string& filename : filenames) {
+            _files.emplace_back(new SignatureFile(filename));
+            if (_files.back()->getSignatureLength()
+                    != _files.front()->getSignatureLength()) {
+                throw runtime_error(filename + " has a different signature length");
+            }
+            _offsets.push_back(_offsets.back() + _files.back()->size());
+        }
+    }
+
+    /**
+     * Thread safe.
+     */
+    size_t read(size_t n, vector<SVector<bool>*>* data) {
+        const size_t total = size();
+        size_t begin = _next.fetch_add(n);
+        if (begin >= total) {
+            return 0;
+        }
+        size_t end = std::min(begin + n, total);
+        SVector<bool>* views = allocateViews(end - begin);
+        // the file containing begin
+        size_t file = std::upper_bound(_offsets.begin(), _offsets.end(), begin)
+                - _offsets.begin() - 1;
+        for (size_t i = begin; i < end; ++i) {
+            while (i >= _offsets[file + 1]) {
+                ++file;
+            }
+            data->push_back(_files[file]->view(i - _offsets[file],
+                    &views[i - begin]));
+        }
+        return end - begin;
+    }
+
+    /**
+     * Thread safe. data must contain exactly the views from one call to
+     * read().
+     */
+    void free(vector<SVector<bool>*>* data) {
+        if (!data->empty()) {
+            destroyViews(data->front(), data->size());
+        }
+    }
+
+    /**
+     * The number of signatures in all files.
+     */
+    size_t size() const {
+        return _offsets.back();
+    }
+
+private:
+    vector<unique_ptr<SignatureFile>> _files;
+    vector<size_t> _offsets; // index of the first signature in each file
+    atomic<size_t> _next; // the next signature to be claimed
+};
+
+template <>
+struct StreamTraits<PartitionedSignatureStream> {
+    static const bool concurrent = true;
+};
+
+} // namespace lmw
+
+#endif	/* PARTITIONEDSIGNATURESTREAM_H */
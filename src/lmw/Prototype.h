@@ -19,6 +19,10 @@
  *
  * For example, floating point vectors can use the mean or median, and bit
  * vectors use a specialized prototype optimized for speed.
+ *
+ * PrototypeReduction<T, PROTOTYPE> describes how to calculate the same
+ * prototype from a running sum instead of a list of objects, so that the sum
+ * can be split over threads and merged. See the end of this file.
  */
 
 #ifndef PROTOTYPE_H
@@ -27,6 +31,7 @@
 #include "StdIncludes.h"
 #include "BitMapList8.h"
 #include "BitMapList16.h"
+#include "BitSlicedAccumulator.h"
 #include "SVector.h"
 
 namespace lmw {
@@ -310,6 +315,53 @@ struct meanBitPrototype8 {
 
 };
 
+/**
+ * A PrototypeReduction calculates the same prototype as PROTOTYPE from an
+ * ACCUMULATOR (see Accumulator.h) holding the sum of the objects and the
+ * number of objects summed, ignoring weights. Each object can then be added
+ * to an accumulator for its cluster wherever it is, and partial accumulators
+ * can be merged.
+ *
+ * The general version is not enabled. Enabled versions provide,
+ *      typedef ... Accumulator;
+ *      static void prototype(T* result, Accumulator& sum, uint64_t count);
+ */
+template <typename T, typename PROTOTYPE>
+struct PrototypeReduction {
+    static const bool enabled = false;
+};
+
+/**
+ * The bit vector prototypes set each bit that is set in more than half of
+ * the objects. The counts come from a BitSlicedAccumulator.
+ */
+struct MajorityBitReduction {
+    static const bool enabled = true;
+
+    typedef BitSlicedAccumulator Accumulator;
+
+    static void prototype(SVector<bool>* result, Accumulator& sum,
+            const uint64_t count) {
+        const uint64_t halfCount = count / 2;
+        result->setAllBlocks(0);
+        for (size_t s = 0; s < result->size(); s++) {
+            if (sum[s] > halfCount) result->set(s);
+        }
+    }
+};
+
+template <>
+struct PrototypeReduction<SVector<bool>, meanBitPrototype> : MajorityBitReduction {
+};
+
+template <>
+struct PrototypeReduction<SVector<bool>, meanBitPrototype2> : MajorityBitReduction {
+};
+
+template <>
+struct PrototypeReduction<SVector<bool>, meanBitPrototype8> : MajorityBitReduction {
+};
+
 } // namespace lmw
 
 #endif	/* PROTOTYPE_H */
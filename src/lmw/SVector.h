@@ -2,6 +2,12 @@
 #define SVECTOR_H
 
 #include "StdIncludes.h"
+#include "HammingKernels.h"
+#include "FloatKernels.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
 
 namespace lmw {
 
@@ -13,24 +19,89 @@ namespace lmw {
 // Typedef for bit vector
 typedef uint64_t block_type;
 
+/**
+ * SVectorStorage allocates the memory owned by SVectors. It is aligned to a
+ * cache line and padded with zeros to a whole number of cache lines, which is
+ * also a whole number of SIMD registers up to 512 bits. Vector kernels can
+ * therefore use aligned loads and process the padding rather than a tail.
+ */
+class SVectorStorage {
+public:
+    static const size_t alignment = 64;
+
+    static size_t paddedBytes(const size_t bytes) {
+        return (bytes + alignment - 1) / alignment * alignment;
+    }
+
+    /**
+     * Allocates paddedBytes(bytes) zeroed bytes.
+     */
+    static void* allocate(const size_t bytes) {
+        const size_t padded = std::max(paddedBytes(bytes), size_t(alignment));
+        void* data = NULL;
+        if (posix_memalign(&data, alignment, padded) != 0) {
+            throw std::bad_alloc();
+        }
+        memset(data, 0, padded);
+        return data;
+    }
+
+    static void release(void* data) {
+        free(data);
+    }
+};
+
+/**
+ * SVector is a dense vector of length values of T, which must be a trivial
+ * type such as float or uint32_t. Its data is allocated by SVectorStorage.
+ * Copies are deep, while moves take the data and leave an empty vector.
+ */
 template <class T>
 class SVector {
 public:
-    SVector(const size_t length) {
-        _length = length;
-        _data = new T[_length];
+    static_assert(std::is_trivial<T>::value, "SVector values must be trivial");
+
+    SVector(const size_t length) : _data(allocate(length)), _length(length) {
     }
 
-    SVector(const SVector<T>& other) {
-        _length = other._length;
-        _data = new T[_length];
-        for (size_t i = 0; i < _length; i++) {
-            _data[i] = other._data[i];
-        }
+    SVector(const SVector<T>& other) : _data(allocate(other._length)),
+            _length(other._length) {
+        std::copy(other._data, other._data + _length, _data);
+    }
+
+    SVector(SVector<T>&& other) : _data(other._data), _length(other._length),
+            _id(std::move(other._id)) {
+        other._data = NULL;
+        other._length = 0;
     }
 
     ~SVector() {
-        delete[] _data;
+        SVectorStorage::release(_data);
+    }
+
+    SVector<T>& operator=(const SVector<T>& other) {
+        if (this != &other) {
+            if (_length != other._length) {
+                T* data = allocate(other._length);
+                SVectorStorage::release(_data);
+                _data = data;
+                _length = other._length;
+            }
+            std::copy(other._data, other._data + _length, _data);
+        }
+        return *this;
+    }
+
+    SVector<T>& operator=(SVector<T>&& other) {
+        if (this != &other) {
+            SVectorStorage::release(_data);
+            _data = other._data;
+            _length = other._length;
+            _id = std::move(other._id);
+            other._data = NULL;
+            other._length = 0;
+        }
+        return *this;
     }
 
     typedef T * iterator;
@@ -41,7 +112,7 @@ public:
     }
     
     const_iterator begin() const {
-        return begin();
+        return &_data[0];
     }
 
     iterator end() {
@@ -49,7 +120,7 @@ public:
     }
 
     const_iterator end() const {
-        return end();
+        return &_data[_length];
     }    
 
     T& operator[](size_t i) {
@@ -109,6 +180,21 @@ public:
         return _length;
     }
 
+    /**
+     * The number of values including the zeroed padding.
+     */
+    size_t paddedSize() const {
+        return SVectorStorage::paddedBytes(_length * sizeof(T)) / sizeof(T);
+    }
+
+    T* getData() {
+        return _data;
+    }
+
+    const T* getData() const {
+        return _data;
+    }
+
     void print() const {
         for (size_t i = 0; i < _length; i++) {
             std::cout << _data[i] << " ";
@@ -116,49 +202,154 @@ public:
     }
 
 protected:
+    static T* allocate(const size_t length) {
+        return static_cast<T*>(SVectorStorage::allocate(length * sizeof(T)));
+    }
+
     T* _data;
     size_t _length;
 	string _id;
 };
 
+/**
+ * SVector<float> adds and scales with the kernels in FloatKernels.h.
+ */
+template <>
+inline void SVector<float>::add(const SVector<float>& other) {
+    FloatKernels::best().addMult(_data, other._data, 1.0f, _length);
+}
+
+template <>
+inline void SVector<float>::addMult(const SVector<float>& other, const float coef) {
+    FloatKernels::best().addMult(_data, other._data, coef, _length);
+}
+
+template <>
+inline void SVector<float>::scale(const float& val) {
+    FloatKernels::best().scale(_data, val, _length);
+}
+
 /// Template specialization for bit vector
+/**
+ * Bit vectors are stored in 64 bit blocks. A length that is not a multiple of
+ * 64 is rounded up to whole blocks and the unused bits of the last block are
+ * kept 0, so whole blocks can be compared. Vectors that own their blocks
+ * allocate them with SVectorStorage and start with all bits 0.
+ */
 template <>
 class SVector <bool> {
 public:
-    SVector(const size_t length) {
-        _length = length;
-        _numBlocks = _length >> BITS_WS;
-        _data = new block_type[_numBlocks];
+    SVector(const size_t length) : _data(allocate(length)),
+            _numBlocks(numBlocks(length)), _length(length), _owner(true),
+            _idData(NULL), _idLength(0) {
+    }
+
+    /**
+     * Creates a view of length bits stored at data. The view does not own or
+     * copy data, which must outlive it and stay 8 byte aligned. If idData is
+     * not NULL the ID is idLength characters at idData and is only copied
+     * into a string the first time getID() is called. A view is not padded
+     * beyond its blocks unless the memory it was created over is.
+     */
+    SVector(block_type* data, const size_t length, const char* idData,
+            const size_t idLength) : _data(data), _numBlocks(numBlocks(length)),
+            _length(length), _owner(false), _idData(idData),
+            _idLength(idLength) {
+    }
+
+    /**
+     * Creates a read only view of length bits stored at data, such as a
+     * signature in a MappedFile. It is otherwise the same as the view above.
+     * The blocks must not be modified through the view.
+     */
+    SVector(const block_type* data, const size_t length, const char* idData,
+            const size_t idLength) : SVector(const_cast<block_type*>(data),
+            length, idData, idLength) {
+    }
+
+    /**
+     * Copies (length + 7) / 8 bytes.
+     */
+    SVector(const void* bytes, const size_t length) : _data(allocate(length)),
+            _numBlocks(numBlocks(length)), _length(length), _owner(true),
+            _idData(NULL), _idLength(0) {
+        memcpy(_data, bytes, (length + 7) / 8);
+        clearUnusedBits();
+    }
+
+    /**
+     * Copies the bits of vec but not its ID.
+     */
+    SVector(const SVector<bool>& vec) : _data(allocate(vec._length)),
+            _numBlocks(vec._numBlocks), _length(vec._length), _owner(true),
+            _idData(NULL), _idLength(0) {
+        memcpy(_data, vec._data, _numBlocks * sizeof(block_type));
+    }
+
+    /**
+     * Takes the blocks and ID of vec, which is left empty.
+     */
+    SVector(SVector<bool>&& vec) : _data(vec._data),
+            _numBlocks(vec._numBlocks), _length(vec._length),
+            _owner(vec._owner), _id(std::move(vec._id)),
+            _idData(vec._idData), _idLength(vec._idLength) {
+        vec.reset();
     }
 
-    SVector(void* bytes, const size_t length) {
-        size_t numBytes = length / 8;
-        _length = length;
-        _numBlocks = _length >> BITS_WS;
-        _data = new block_type[_numBlocks];
-        memcpy(reinterpret_cast<uint8_t*>(_data), bytes, numBytes);
+    ~SVector() {
+        if (_owner) {
+            SVectorStorage::release(_data);
+        }
     }
 
-    SVector(const SVector<bool>& vec) {
-        _length = vec._length;
-        _numBlocks = vec._numBlocks;
-        _data = new block_type[_numBlocks];
-
-        // initialise bit vector
-        for (int i = 0; i < _numBlocks; i++) {
-            setBlock(i, vec._data[i]);
+    /**
+     * Copies the bits of vec but not its ID. The blocks are reused if this
+     * vector owns blocks of the same length, otherwise it gets its own.
+     */
+    SVector<bool>& operator=(const SVector<bool>& vec) {
+        if (this != &vec) {
+            if (!_owner || _length != vec._length) {
+                block_type* data = allocate(vec._length);
+                if (_owner) {
+                    SVectorStorage::release(_data);
+                }
+                _data = data;
+                _numBlocks = vec._numBlocks;
+                _length = vec._length;
+                _owner = true;
+            }
+            memcpy(_data, vec._data, _numBlocks * sizeof(block_type));
         }
+        return *this;
     }
 
-    ~SVector() {
-        delete[] _data;
+    SVector<bool>& operator=(SVector<bool>&& vec) {
+        if (this != &vec) {
+            if (_owner) {
+                SVectorStorage::release(_data);
+            }
+            _data = vec._data;
+            _numBlocks = vec._numBlocks;
+            _length = vec._length;
+            _owner = vec._owner;
+            _id = std::move(vec._id);
+            _idData = vec._idData;
+            _idLength = vec._idLength;
+            vec.reset();
+        }
+        return *this;
     }
 
     void setID(const string& id) {
         _id = id;
+        _idData = NULL;
     }
 
     const string& getID() const {
+        if (_idData) {
+            _id.assign(_idData, _idLength);
+            _idData = NULL;
+        }
         return _id;
     }
 
@@ -170,6 +361,14 @@ public:
         return _numBlocks;
     }
 
+    /**
+     * The number of blocks including the zeroed padding of owned blocks.
+     */
+    size_t getNumPaddedBlocks() const {
+        return _owner ? SVectorStorage::paddedBytes(_numBlocks * sizeof(block_type))
+                / sizeof(block_type) : _numBlocks;
+    }
+
     block_type* getData() {
         return _data;
     }
@@ -182,6 +381,7 @@ public:
         for (size_t i = 0; i < _numBlocks; i++) {
             _data[i] = v;
         }
+        clearUnusedBits();
     }
 
 	// Be careful of the semantics of this method.
@@ -208,7 +408,7 @@ public:
 
     int popCount() const {
         int count = 0;
-        for (int i = 0; i < _numBlocks; i++) {
+        for (size_t i = 0; i < _numBlocks; i++) {
             count += popcnt64(_data[i]);
         }    
         return count;
@@ -217,7 +417,7 @@ public:
     void exclusiveor(const SVector<bool>& v1) const {
         int count = 0;
         block_type t;
-        for (int i = 0; i < _numBlocks; i++) {
+        for (size_t i = 0; i < _numBlocks; i++) {
             t = _data[i] ^ v1._data[i];
         }
     }
@@ -225,7 +425,7 @@ public:
     int hammingDIstance(const SVector<bool> &other) const {
         int count = 0;
         block_type exclusiveor;
-        for (int i = 0; i < _numBlocks; ++i) {
+        for (size_t i = 0; i < _numBlocks; ++i) {
             exclusiveor = _data[i] ^ other._data[i];
             count += popcnt64(exclusiveor);
         }
@@ -264,13 +464,14 @@ public:
     }
 
     void invert() {
-        for (int i = 0; i < _numBlocks; i++) _data[i] = ~_data[i];
+        for (size_t i = 0; i < _numBlocks; i++) _data[i] = ~_data[i];
+        clearUnusedBits();
     }
 
     void print() const {
         size_t count = 0;
 
-        for (int i = 0; i < _numBlocks; i++) {
+        for (size_t i = 0; i < _numBlocks; i++) {
             for (int j = W_SIZE - 1; j >= 0; j--) {
                 if (_data[i] & (1LL << (j & MASK))) std::cout << '1';
                 else std::cout << '0';
@@ -281,93 +482,59 @@ public:
     }
 
     static inline int popcnt64(block_type b64) {
-#ifdef __GNUC__
-        // uses POPCNT instruction if available, otherwise lookup table
-        return __builtin_popcountll(b64);
-#else
-        block_type x(b64);
-        x = x - ((x >> 1) & 0x5555555555555555ULL);
-        x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
-        x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
-        x = (x * 0x0101010101010101ULL) >> 56;
-        return int(x);
-#endif
+        return HammingKernels::popcnt64(b64);
     }
 
+    /**
+     * Uses the fastest Hamming distance kernel supported by this CPU. See
+     * HammingKernels.h. When both vectors own their blocks, the blocks are
+     * rounded up into the zeroed padding to the width of the kernel, so it
+     * needs no tail loop.
+     */
     static int hammingDistance(const SVector<bool>& v1, const SVector<bool>& v2) {
-        int count = 0;
-        const size_t numBlocks = v1.getNumBlocks();
-        const block_type* data1 = v1.getData(), * data2 = v2.getData();
-
-#if 0
-        block_type exor;
-        for (int i = 0; i < numBlocks; i++) {
-            exor = data1[i] ^ data2[i];
-            count += popcnt64(exor);
-        }
-        return count;
-#endif
+        return HammingKernels::distance(v1.getData(), v2.getData(),
+                HammingKernels::blocks(std::min(v1.getNumBlocks(), v2.getNumBlocks()),
+                std::min(v1.getNumPaddedBlocks(), v2.getNumPaddedBlocks())));
+    }
 
-// The loop unrolled version is faster on the following systems.  Measured on
-// Streaming EM-tree in streamingEMTree() on 2.6 million 4096 bit Wikipedia
-// signatures (the ones from the README.md). Improvements to Hamming distance
-// are double reported for Streaming EM-tree because only half the time in the
-// algorithm is spend on Hamming distance. The other half is unpacking vectors
-// into accumulators.
-//
-// 2009 MacBook Pro
-// - Streaming EM-tree is about 10% faster (33 vs 37 seconds per iteration)
-// - Intel(R) Core(TM)2 Duo CPU     T9600  @ 2.80GHz
-// - 2 x 4GB DDR3 @ 1333 MHz
-// - Apple LLVM version 6.1.0 (clang-602.0.49) (based on LLVM 3.6.0svn)
-// - OS X 10.10
-//
-// 2015 MacBook Pro
-// - Streaming EM-tree is about 5% faster (11.5 vs 12 seconds per iteration)
-// - Intel(R) Core(TM) i5-5257U CPU @ 2.70GHz
-// - 8GB 1866MHz LPDDR3
-// - gcc (Ubuntu 4.9.2-10ubuntu13) 4.9.2
-// - Ubuntu 15.04
-#if 1
-        // It is possible numBlocks is not divisible by 8.
-        // For example, 640 bit vectors have 10 * 64-bit chunks.
-        // Therefore, there will be 2 remaining chunks when unrolling 8 chunks
-        // at a time for 640 bit vectors.
-        block_type exor, exor1, exor2, exor3, exor4, exor5, exor6, exor7;
-        size_t remainder = numBlocks % 8;
-        size_t end8Chunks = numBlocks - remainder;
-        int i = 0;
-        for ( ; i < end8Chunks; i += 8) {
-            exor = data1[i] ^ data2[i];
-            count += popcnt64(exor);
-            exor1 = data1[i+1] ^ data2[i+1];
-            count += popcnt64(exor1);
-            exor2 = data1[i+2] ^ data2[i+2];
-            count += popcnt64(exor2);
-            exor3 = data1[i+3] ^ data2[i+3];
-            count += popcnt64(exor3);
-            exor4 = data1[i+4] ^ data2[i+4];
-            count += popcnt64(exor4);
-            exor5 = data1[i+5] ^ data2[i+5];
-            count += popcnt64(exor5);
-            exor6 = data1[i+6] ^ data2[i+6];
-            count += popcnt64(exor6);
-            exor7 = data1[i+7] ^ data2[i+7];
-            count += popcnt64(exor7);
-        }
-        for ( ; i < numBlocks; i++) {
-            exor = data1[i] ^ data2[i];
-            count += popcnt64(exor);
+private:
+    static size_t numBlocks(const size_t length) {
+        return (length + W_SIZE - 1) >> BITS_WS;
+    }
+
+    static block_type* allocate(const size_t length) {
+        return static_cast<block_type*>(SVectorStorage::allocate(
+                numBlocks(length) * sizeof(block_type)));
+    }
+
+    /**
+     * Zeros the bits of the last block beyond the length.
+     */
+    void clearUnusedBits() {
+        if (_length & MASK) {
+            _data[_numBlocks - 1] &= (block_type(1) << (_length & MASK)) - 1;
         }
-        return count;
-#endif
     }
 
-private:
+    /**
+     * Leaves a moved from vector empty.
+     */
+    void reset() {
+        _data = NULL;
+        _numBlocks = 0;
+        _length = 0;
+        _owner = false;
+        _idData = NULL;
+        _idLength = 0;
+    }
+
     block_type* _data;
-    int _numBlocks;
+    size_t _numBlocks;
     size_t _length;
-    string _id;
+    bool _owner; // false for views created over memory owned elsewhere
+    mutable string _id;
+    mutable const char* _idData; // unresolved ID of a view
+    size_t _idLength;
 };
 
 } // namespace lmw
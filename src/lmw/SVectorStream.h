@@ -3,6 +3,7 @@
 
 #include "StdIncludes.h"
 #include "SVector.h"
+#include "BitVectorSlab.h"
 
 namespace lmw {
 
@@ -30,6 +31,37 @@ namespace lmw {
  *          bvs.free(&data);
  *      }
  */
+/**
+ * StreamTraits<STREAM>::concurrent is true if a VectorStream allows read()
+ * and free() to be called from many threads at once. Streams are assumed to
+ * be sequential unless they specialize StreamTraits.
+ */
+template <typename STREAM>
+struct StreamTraits {
+    static const bool concurrent = false;
+};
+
+/**
+ * Reads and discards up to n vectors from a VectorStream. Returns the number
+ * skipped. Streams with random access, such as SignatureFileStream, can seek
+ * instead.
+ */
+template <typename STREAM>
+size_t skipVectors(STREAM& vs, const size_t n) {
+    const size_t chunk = 10000;
+    size_t skipped = 0;
+    while (skipped < n) {
+        vector<SVector<bool>*> data;
+        size_t read = vs.read(std::min(chunk, n - skipped), &data);
+        vs.free(&data);
+        if (read == 0) {
+            break;
+        }
+        skipped += read;
+    }
+    return skipped;
+}
+
 template <typename SVECTOR>
 class SVectorStream {
     size_t read(size_t n, vector<SVECTOR*>* data) {
@@ -69,7 +101,8 @@ public:
             _signatureStream(signatureFile, ios::in | ios::binary),
             _signatureLength(signatureLength),
             _maxToRead(maxToRead),
-            _count(0) {
+            _count(0),
+            _slabs(false) {
         if (signatureLength % 64 != 0) {
             throw runtime_error("length is not divisible by 64");
         }
@@ -81,10 +114,23 @@ public:
         }
 	}
 
+    /**
+     * With slabs each call to read() stores all the vectors it returns in
+     * one BitVectorSlab rather than allocating every vector and ID
+     * separately. The vectors must then only be released by free(). Slabs
+     * are disabled by default.
+     */
+    void setSlabs(const bool slabs) {
+        _slabs = slabs;
+    }
+
     size_t read(size_t n, vector<SVector<bool>*>* data) {
         string id;
         size_t read = 0;
 		if (_maxToRead != -1 && _count >= _maxToRead) return 0;
+        if (_slabs) {
+            return readSlab(n, data);
+        }
 		while (getline(_idStream, id)) {
             _signatureStream.read(&_buffer[0], _buffer.size());
             SVector<bool>* vector = new SVector<bool>(&_buffer[0], _signatureLength);
@@ -100,18 +146,48 @@ public:
     }
     
     void free(vector<SVector<bool>*>* data) {
+        if (_slabs) {
+            BitVectorSlab::destroy(data);
+            return;
+        }
         for (auto vector : *data) {
             delete vector;
         }
     }
     
 private:
+    /**
+     * Reads signatures straight into a slab.
+     */
+    size_t readSlab(size_t n, vector<SVector<bool>*>* data) {
+        if (_maxToRead != -1) {
+            n = std::min(n, _maxToRead - _count);
+        }
+        BitVectorSlab* slab = BitVectorSlab::create(n, _signatureLength);
+        string id;
+        size_t read = 0;
+        while (read < n && getline(_idStream, id)) {
+            _signatureStream.read(reinterpret_cast<char*>(slab->getBits(read)),
+                    _buffer.size());
+            slab->addID(id);
+            ++read;
+        }
+        _count += read;
+        if (read == 0) {
+            slab->destroy();
+        } else {
+            slab->release(data);
+        }
+        return read;
+    }
+
     vector<char> _buffer; // temporary buffer for reading a signature
     ifstream _idStream;
     ifstream _signatureStream;
     size_t _signatureLength; // the length of signatures in _signatureStream
 	size_t _maxToRead;
 	size_t _count; // Number of vectors read so far
+    bool _slabs; // store each chunk in a BitVectorSlab
 };
 
 } // namespace lmw
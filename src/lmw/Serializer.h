@@ -0,0 +1,50 @@
+#ifndef SERIALIZER_H
+#define	SERIALIZER_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+
+#include <cstring>
+
+namespace lmw {
+
+/**
+ * Serializer<T> writes objects of type T to a binary stream and reads them
+ * back from memory, for example from a memory mapped file. All objects
+ * written for one tree have the same number of dimensions, so it is stored
+ * once by the caller rather than with every object.
+ *
+ *      size_t Serializer<T>::bytes(size_t dimensions)
+ *      void Serializer<T>::write(std::ostream& out, const T& object)
+ *      T* Serializer<T>::read(const char* data, size_t dimensions)
+ *
+ * Only bit vectors are supported.
+ */
+template <typename T>
+struct Serializer;
+
+template <>
+struct Serializer<SVector<bool>> {
+    /**
+     * The last byte is padded with zero bits when dimensions is not a
+     * multiple of 8.
+     */
+    static size_t bytes(const size_t dimensions) {
+        return (dimensions + 7) / 8;
+    }
+
+    static void write(std::ostream& out, const SVector<bool>& vector) {
+        out.write(reinterpret_cast<const char*>(vector.getData()),
+                bytes(vector.size()));
+    }
+
+    static SVector<bool>* read(const char* data, const size_t dimensions) {
+        SVector<bool>* vector = new SVector<bool>(dimensions);
+        memcpy(vector->getData(), data, bytes(dimensions));
+        return vector;
+    }
+};
+
+} // namespace lmw
+
+#endif	/* SERIALIZER_H */
@@ -0,0 +1,458 @@
+#ifndef SIGNATUREFILE_H
+#define	SIGNATUREFILE_H
+
+#include "StdIncludes.h"
+#include "MappedFile.h"
+#include "MappedSVectorStream.h"
+#include "SVector.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace lmw {
+
+/**
+ * A signature file holds bit vector signatures and their IDs in one
+ * self-describing binary file. It replaces the pair of an ASCII ID file and a
+ * raw signature file that must be kept line aligned, and allows any
+ * signature or range of signatures to be found without reading what comes
+ * before it.
+ *
+ * The layout is, with all integers little endian,
+ *
+ *      SignatureFileHeader   128 bytes
+ *      padding               to signatureOffset, a multiple of 4096
+ *      signatures            count * signatureLength / 8 bytes
+ *      ID index              count + 1 uint64_t offsets into the ID data
+ *      ID data               IDs without separators
+ *
+ * ID i is the bytes [index[i], index[i + 1]) of the ID data. Every
+ * signature starts on an 8 byte boundary so it can be used as an
+ * SVector<bool> view without copying.
+ *
+ * The header holds a checksum of the signatures and one of the ID index and
+ * data. They are only checked by SignatureFile::verify() because doing so
+ * reads the whole file. Opening a file checks that the sections fit in it
+ * and that the ID index is in order, which reads the index but not the
+ * signatures.
+ */
+struct SignatureFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t signatureLength; // in bits
+    uint64_t count;
+    uint64_t signatureOffset;
+    uint64_t idIndexOffset;
+    uint64_t idDataOffset;
+    uint64_t idDataSize;
+    uint64_t signatureChecksum;
+    uint64_t idChecksum;
+    uint64_t reserved[6];
+};
+
+static_assert(sizeof(SignatureFileHeader) == 128,
+        "SignatureFileHeader must be 128 bytes");
+
+/**
+ * Constants and checksums shared by SignatureFile and SignatureFileWriter.
+ */
+struct SignatureFileFormat {
+    static constexpr const char* magic = "LMWSIG\r\n";
+    static const uint32_t version = 1;
+    static const uint64_t alignment = 4096;
+
+    static uint64_t align(const uint64_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    static const uint64_t checksumBasis = 14695981039346656037ULL;
+
+    /**
+     * 64-bit FNV-1a over 64-bit words for signatures. Bytes are too slow to
+     * hash one at a time at hundreds of gigabytes.
+     */
+    static uint64_t checksumWords(uint64_t hash, const uint64_t* words,
+            const size_t numWords) {
+        for (size_t i = 0; i < numWords; ++i) {
+            hash = (hash ^ words[i]) * 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    /**
+     * 64-bit FNV-1a over bytes for IDs.
+     */
+    static uint64_t checksumBytes(uint64_t hash, const void* data,
+            const size_t bytes) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < bytes; ++i) {
+            hash = (hash ^ p[i]) * 1099511628211ULL;
+        }
+        return hash;
+    }
+};
+
+/**
+ * Read only random access to a signature file. The file is memory mapped
+ * read only, so opening it is cheap, it may be larger than memory and
+ * signatures are read only views into the mapping.
+ *
+ * For example,
+ *      SignatureFile file("wiki.4096.lmwsig");
+ *      const block_type* signature = file.getSignature(42);
+ *      string id = file.getID(42);
+ */
+class SignatureFile {
+public:
+    explicit SignatureFile(const string& filename) : _file(filename) {
+        if (_file.size() < sizeof(SignatureFileHeader)) {
+            throw runtime_error(filename + " is too short to be a signature file");
+        }
+        memcpy(&_header, _file.data(), sizeof(SignatureFileHeader));
+        if (memcmp(_header.magic, SignatureFileFormat::magic,
+                sizeof(_header.magic)) != 0) {
+            throw runtime_error(filename + " is not a signature file");
+        }
+        if (_header.version != SignatureFileFormat::version) {
+            throw runtime_error(filename + " has an unsupported version");
+        }
+        if (_header.signatureLength == 0 || _header.signatureLength % 64 != 0) {
+            throw runtime_error(filename + " has an invalid signature length");
+        }
+        _signatureBytes = _header.signatureLength / 8;
+        const uint64_t size = _file.size();
+        if (_header.signatureOffset % 8 != 0 || _header.idIndexOffset % 8 != 0
+                || !fits(_header.signatureOffset, _header.count, _signatureBytes, size)
+                || !fits(_header.idIndexOffset, _header.count + 1, sizeof(uint64_t), size)
+                || !fits(_header.idDataOffset, _header.idDataSize, 1, size)) {
+            throw runtime_error(filename + " is truncated or corrupt");
+        }
+        _signatures = reinterpret_cast<const block_type*>(_file.data()
+                + _header.signatureOffset);
+        _idIndex = reinterpret_cast<const uint64_t*>(_file.data()
+                + _header.idIndexOffset);
+        _idData = _file.data() + _header.idDataOffset;
+        // getIDData() trusts the index, so every ID must lie in the ID data
+        if (_idIndex[0] != 0 || _idIndex[_header.count] != _header.idDataSize) {
+            throw runtime_error(filename + " has an inconsistent ID index");
+        }
+        for (uint64_t i = 0; i < _header.count; ++i) {
+            if (_idIndex[i] > _idIndex[i + 1]) {
+                throw runtime_error(filename + " has an inconsistent ID index");
+            }
+        }
+    }
+
+    size_t size() const {
+        return _header.count;
+    }
+
+    size_t getSignatureLength() const {
+        return _header.signatureLength;
+    }
+
+    const SignatureFileHeader& getHeader() const {
+        return _header;
+    }
+
+    const block_type* getSignature(const size_t i) const {
+        return _signatures + i * (_signatureBytes / sizeof(block_type));
+    }
+
+    const char* getIDData(const size_t i, size_t* length) const {
+        *length = _idIndex[i + 1] - _idIndex[i];
+        return _idData + _idIndex[i];
+    }
+
+    string getID(const size_t i) const {
+        size_t length;
+        const char* id = getIDData(i, &length);
+        return string(id, length);
+    }
+
+    /**
+     * Appends views of the signatures [begin, end) to data. The views share
+     * one allocation and must be released with free().
+     */
+    size_t read(const size_t begin, const size_t end,
+            vector<SVector<bool>*>* data) const {
+        if (begin >= end) {
+            return 0;
+        }
+        if (end > size()) {
+            throw runtime_error("signature range is out of bounds");
+        }
+        SVector<bool>* views = allocateViews(end - begin);
+        for (size_t i = begin; i < end; ++i) {
+            data->push_back(view(i, &views[i - begin]));
+        }
+        return end - begin;
+    }
+
+    /**
+     * Constructs a view of signature i in the uninitialized space at place.
+     */
+    SVector<bool>* view(const size_t i, SVector<bool>* place) const {
+        size_t idLength;
+        const char* id = getIDData(i, &idLength);
+        return new (place) SVector<bool>(getSignature(i),
+                _header.signatureLength, id, idLength);
+    }
+
+    /**
+     * data must contain exactly the views from one call to read().
+     */
+    void free(vector<SVector<bool>*>* data) const {
+        if (!data->empty()) {
+            destroyViews(data->front(), data->size());
+        }
+    }
+
+    /**
+     * Recomputes the checksums and compares them with the header. This reads
+     * the whole file.
+     */
+    bool verify() const {
+        uint64_t signatureChecksum = SignatureFileFormat::checksumWords(
+                SignatureFileFormat::checksumBasis, _signatures,
+                size() * _signatureBytes / sizeof(block_type));
+        uint64_t idChecksum = SignatureFileFormat::checksumBytes(
+                SignatureFileFormat::checksumBasis, _idIndex,
+                (size() + 1) * sizeof(uint64_t));
+        idChecksum = SignatureFileFormat::checksumBytes(idChecksum, _idData,
+                _header.idDataSize);
+        return signatureChecksum == _header.signatureChecksum
+                && idChecksum == _header.idChecksum;
+    }
+
+private:
+    /**
+     * Whether count items of itemBytes starting at offset fit in size bytes,
+     * without overflowing.
+     */
+    static bool fits(const uint64_t offset, const uint64_t count,
+            const uint64_t itemBytes, const uint64_t size) {
+        return offset <= size && count <= (size - offset) / itemBytes;
+    }
+
+    MappedFile _file;
+    SignatureFileHeader _header;
+    size_t _signatureBytes;
+    const block_type* _signatures;
+    const uint64_t* _idIndex;
+    const char* _idData;
+};
+
+/**
+ * A VectorStream over the signatures [begin, end) of a SignatureFile. See
+ * SVectorStream.h. Like MappedSVectorStream it returns views, so the
+ * SignatureFile must outlive the vectors read from it.
+ *
+ * For example,
+ *      SignatureFile file("wiki.4096.lmwsig");
+ *      SignatureFileStream vs(file);
+ *      emtree.insert(vs);
+ */
+class SignatureFileStream {
+public:
+    explicit SignatureFileStream(const SignatureFile& file)
+            : SignatureFileStream(file, 0, file.size()) { }
+
+    SignatureFileStream(const SignatureFile& file, const size_t begin,
+            const size_t end) : _file(file), _position(begin),
+            _end(std::min(end, file.size())) { }
+
+    size_t read(size_t n, vector<SVector<bool>*>* data) {
+        size_t end = _position + std::min(n, _end - std::min(_position, _end));
+        size_t read = _file.read(_position, end, data);
+        _position = end;
+        return read;
+    }
+
+    void free(vector<SVector<bool>*>* data) {
+        _file.free(data);
+    }
+
+    /**
+     * Moves to signature i. Seeking is O(1).
+     */
+    void seek(const size_t i) {
+        _position = i;
+    }
+
+private:
+    const SignatureFile& _file;
+    size_t _position;
+    size_t _end;
+};
+
+/**
+ * Writes a signature file one signature at a time. Signatures are written
+ * straight to the output. IDs and their offsets go to temporary files next
+ * to it, which are appended when the writer is closed, so memory use does
+ * not grow with the number of signatures.
+ *
+ * For example,
+ *      SignatureFileWriter writer("wiki.4096.lmwsig", 4096);
+ *      writer.add(*vector);
+ *      writer.close();
+ */
+class SignatureFileWriter {
+public:
+    SignatureFileWriter(const string& filename, const size_t signatureLength)
+            : _filename(filename),
+            _idFilename(filename + ".ids.tmp"),
+            _indexFilename(filename + ".index.tmp"),
+            _out(filename, ios::out | ios::binary | ios::trunc),
+            _ids(_idFilename, ios::out | ios::binary | ios::trunc),
+            _index(_indexFilename, ios::out | ios::binary | ios::trunc),
+            _signatureLength(signatureLength),
+            _count(0),
+            _idDataSize(0),
+            _signatureChecksum(SignatureFileFormat::checksumBasis),
+            _indexChecksum(SignatureFileFormat::checksumBasis),
+            _closed(false) {
+        if (signatureLength == 0 || signatureLength % 64 != 0) {
+            throw runtime_error("length is not divisible by 64");
+        }
+        if (!_out || !_ids || !_index) {
+            throw runtime_error("failed to open " + filename + " for writing");
+        }
+        // the header is written by close() once the counts are known
+        vector<char> padding(SignatureFileFormat::align(sizeof(SignatureFileHeader)), 0);
+        _out.write(&padding[0], padding.size());
+        addIndex(0);
+    }
+
+    ~SignatureFileWriter() {
+        if (!_closed) {
+            try {
+                close();
+            } catch (const std::exception&) {
+            }
+        }
+    }
+
+    void add(const SVector<bool>& signature) {
+        add(signature, signature.getID());
+    }
+
+    void add(const SVector<bool>& signature, const string& id) {
+        if (signature.size() != _signatureLength) {
+            throw runtime_error("signature has the wrong length");
+        }
+        _out.write(reinterpret_cast<const char*>(signature.getData()),
+                _signatureLength / 8);
+        _signatureChecksum = SignatureFileFormat::checksumWords(
+                _signatureChecksum, signature.getData(), signature.getNumBlocks());
+        _ids.write(id.data(), id.size());
+        _idDataSize += id.size();
+        addIndex(_idDataSize);
+        ++_count;
+    }
+
+    size_t size() const {
+        return _count;
+    }
+
+    /**
+     * Appends the ID index and data and writes the header.
+     */
+    void close() {
+        if (_closed) {
+            return;
+        }
+        _closed = true;
+        _ids.close();
+        _index.close();
+
+        SignatureFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SignatureFileFormat::magic, sizeof(header.magic));
+        header.version = SignatureFileFormat::version;
+        header.headerSize = sizeof(SignatureFileHeader);
+        header.signatureLength = _signatureLength;
+        header.count = _count;
+        header.signatureOffset = SignatureFileFormat::align(sizeof(SignatureFileHeader));
+        header.idIndexOffset = header.signatureOffset + _count * (_signatureLength / 8);
+        header.idDataOffset = header.idIndexOffset + (_count + 1) * sizeof(uint64_t);
+        header.idDataSize = _idDataSize;
+        header.signatureChecksum = _signatureChecksum;
+        // the ID checksum covers the index followed by the data
+        header.idChecksum = _indexChecksum;
+        {
+            ifstream ids(_idFilename, ios::in | ios::binary);
+            char buffer[1 << 16];
+            while (ids.read(buffer, sizeof(buffer)) || ids.gcount() > 0) {
+                header.idChecksum = SignatureFileFormat::checksumBytes(
+                        header.idChecksum, buffer, ids.gcount());
+            }
+        }
+        append(_indexFilename);
+        append(_idFilename);
+        _out.seekp(0);
+        _out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        _out.close();
+        std::remove(_idFilename.c_str());
+        std::remove(_indexFilename.c_str());
+        if (!_out) {
+            throw runtime_error("failed to write " + _filename);
+        }
+    }
+
+private:
+    void addIndex(const uint64_t offset) {
+        _index.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+        _indexChecksum = SignatureFileFormat::checksumBytes(_indexChecksum,
+                &offset, sizeof(offset));
+    }
+
+    void append(const string& filename) {
+        ifstream in(filename, ios::in | ios::binary);
+        if (in.peek() != std::char_traits<char>::eof()) {
+            _out << in.rdbuf();
+        }
+    }
+
+    string _filename;
+    string _idFilename;
+    string _indexFilename;
+    ofstream _out;
+    ofstream _ids;
+    ofstream _index;
+    size_t _signatureLength;
+    uint64_t _count;
+    uint64_t _idDataSize;
+    uint64_t _signatureChecksum;
+    uint64_t _indexChecksum;
+    bool _closed;
+};
+
+/**
+ * Converts a line aligned ID file and raw signature file, as read by
+ * SVectorStream, into a signature file. Returns the number of signatures.
+ */
+inline size_t convertSignatureFile(const string& idFile,
+        const string& signatureFile, const size_t signatureLength,
+        const string& outputFile) {
+    MappedSVectorStream vs(idFile, signatureFile, signatureLength);
+    SignatureFileWriter writer(outputFile, signatureLength);
+    for (;;) {
+        vector<SVector<bool>*> data;
+        size_t read = vs.read(100000, &data);
+        if (read == 0) {
+            break;
+        }
+        for (auto vector : data) {
+            writer.add(*vector);
+        }
+        vs.free(&data);
+    }
+    writer.close();
+    return writer.size();
+}
+
+} // namespace lmw
+
+#endif	/* SIGNATUREFILE_H */
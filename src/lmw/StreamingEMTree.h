@@ -2,11 +2,20 @@
 #define	STREAMINGEMTREE_H
 
 #include "StdIncludes.h"
+#include "Accumulator.h"
+#include "ChunkSizer.h"
 #include "SVectorStream.h"
 #include "ClusterVisitor.h"
 #include "InsertVisitor.h"
+#include "KeyMatrix.h"
+#include "MappedFile.h"
+#include "Serializer.h"
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
 #include "tbb/mutex.h"
+#include "tbb/parallel_for.h"
 #include "tbb/pipeline.h"
+#include "tbb/tick_count.h"
 
 namespace lmw {
 
@@ -23,14 +32,25 @@ namespace lmw {
  * T is the type of vector stored in the node.
  *
  * ACCUMULATOR is the the type used for the accumulator vectors. For example,
- * with bit vectors, integer accumulators are used.
- *
- * ACCUMULATORs must support being constructed with the number of dimensions,
- * auto a = ACCUMULATOR(dimensions);
- * They must also support the add operation at a given dimension,
- * a[i] += 1;
+ * with bit vectors, integer accumulators such as SVector<uint32_t> or the
+ * faster BitSlicedAccumulator are used. See Accumulator.h for the operations
+ * an ACCUMULATOR must support.
  *
  * OPTIMIZER provides the functions necessary for optimization.
+ *
+ * By default inserts lock the leaf cluster they update. With
+ * setThreadLocalAccumulators(true) each thread instead updates its own
+ * shard of the leaf accumulators without locking, and the shards are merged
+ * into the tree by mergeAccumulators(). This happens automatically at the end
+ * of insert(STREAM&) and before update() and prune().
+ *
+ * save() writes a checkpoint of the whole tree, including accumulators, and
+ * load() restores it, so a long run can be resumed after a failure.
+ *
+ * Streams are processed in chunks of setReadSize() vectors with up to
+ * setMaxTokens() chunks in memory. With setAdaptiveReadSize(true) the chunk
+ * size is instead tuned while a stream is processed, within the budget set
+ * by setMemoryBudget() (see ChunkSizer.h).
  */
 template <typename T, typename ACCUMULATOR, typename OPTIMIZER>
 class StreamingEMTree {
@@ -39,32 +59,103 @@ public:
         _root(new Node<AccumulatorKey>()) {
             _root->setOwnsKeys(true);
             deepCopy(root, _root);
+            packKeys(_root);
+    }
+
+    /**
+     * Where a run was when a checkpoint was saved. It is stored with the tree
+     * so a run can resume from the last completed iteration or mini-batch.
+     */
+    struct Progress {
+        Progress() : iteration(0), batch(0), vectorsRead(0), job(0) { }
+
+        uint64_t iteration; // iterations completed
+        uint64_t batch; // mini-batches completed in the current iteration
+        uint64_t vectorsRead; // vectors read in the current iteration
+        uint64_t job; // identifies the run, e.g. a hash of its settings
+    };
+
+    /**
+     * Restores a tree written by save(). The checkpoint is memory mapped and
+     * copied straight into the tree. If progress is not NULL it is set to the
+     * progress saved with the tree.
+     */
+    static StreamingEMTree* load(const string& filename,
+            Progress* progress = NULL) {
+        MappedFile file(filename);
+        const char* data = file.data();
+        const char* end = data + file.size();
+        CheckpointHeader header = loadHeader(file, filename);
+        data += sizeof(header);
+        StreamingEMTree* tree = new StreamingEMTree();
+        try {
+            data = tree->load(data, end, tree->_root, header.dimensions);
+        } catch (...) {
+            delete tree;
+            throw;
+        }
+        if (data != end) {
+            delete tree;
+            throw runtime_error(filename + " is corrupt");
+        }
+        tree->updateStatistics(tree->_root);
+        tree->packKeys(tree->_root);
+        if (progress) {
+            *progress = progressOf(header);
+        }
+        return tree;
+    }
+
+    /**
+     * Reads only the progress saved with a checkpoint.
+     */
+    static Progress loadProgress(const string& filename) {
+        MappedFile file(filename);
+        return progressOf(loadHeader(file, filename));
     }
 
     ~StreamingEMTree() {
         delete _root;
+        for (auto& shards : _shards) {
+            for (auto& shard : shards) {
+                delete shard.accumulator;
+            }
+        }
     }
 
-    size_t visit(SVectorStream<T>& vs, InsertVisitor<T>& visitor) {
-        size_t totalRead = 0;
+    /**
+     * STREAM follows the VectorStream concept in SVectorStream.h, for example
+     * SVectorStream or MappedSVectorStream. If StreamTraits<STREAM>::concurrent
+     * is true the stream is read by many threads at once rather than one.
+     *
+     * Visiting counts each vector and its squared distance in the nearest
+     * leaf like insert(STREAM&), but does not change the accumulators.
+     */
+    template <typename STREAM>
+    size_t visit(STREAM& vs, InsertVisitor<T>& visitor) {
+        atomic<size_t> totalRead(0);
+        unique_ptr<ChunkSizer> sizer(chunkSizer());
 
         // setup parallel processing pipeline
-        tbb::parallel_pipeline(_maxtokens,
-                // Input filter reads readsize chunks of vectors in serial
+        tbb::parallel_pipeline(sizer->tokens(),
+                // Input filter reads readsize chunks of vectors
                 tbb::make_filter<void, vector < SVector<bool>*>*>(
-                tbb::filter::serial_out_of_order,
-                inputFilter(vs, totalRead)
+                inputMode<STREAM>(),
+                inputFilter(vs, totalRead, *sizer)
                 ) &
                 // Visit filter visits readsize chunks of vectors into streaming EM-tree in parallel
                 tbb::make_filter < vector < SVector<bool>*>*, void>(
                 tbb::filter::parallel,
                 [&] (vector < SVector<bool>*>* data) -> void {
+                    tbb::tick_count start = tbb::tick_count::now();
                     visit(*data, visitor);
+                    sizer->record(*data, (tbb::tick_count::now() - start).seconds());
                     vs.free(data);
                             delete data;
                 }
         )
         );
+        updateStatistics(_root);
 
         return totalRead;
     }
@@ -73,45 +164,59 @@ public:
         visit(NULL, _root, visitor);
     }
 
-    void visit(vector<T*>& data, InsertVisitor<T>& visitor) const {
+    /**
+     * Visit is thread safe. Like insert(vector<T*>&) it only updates the
+     * leaves, so mergeAccumulators() must be called before statistics are
+     * read from the tree.
+     */
+    void visit(vector<T*>& data, InsertVisitor<T>& visitor) {
         for (T* object : data) {
             visit(_root, object, visitor);
         }
     }
 
-    size_t insert(SVectorStream<T>& vs) {
+    template <typename STREAM>
+    size_t insert(STREAM& vs) {
         return insert(vs, -1);
     }
 
     /** Returns the total number of vectors read from the stream.
      *  Returns 0 if the end of the stream has been reached.
      */
-    size_t insert(SVectorStream<T>& vs, const size_t maxToRead) {
-        size_t totalRead = 0;
+    template <typename STREAM>
+    size_t insert(STREAM& vs, const size_t maxToRead) {
+        atomic<size_t> totalRead(0);
+        unique_ptr<ChunkSizer> sizer(chunkSizer());
 
         // setup parallel processing pipeline
-        tbb::parallel_pipeline(_maxtokens,
-                // Input filter reads readsize chunks of vectors in serial
+        tbb::parallel_pipeline(sizer->tokens(),
+                // Input filter reads readsize chunks of vectors
                 tbb::make_filter<void, vector < SVector<bool>*>*>(
-                tbb::filter::serial_out_of_order,
-                inputFilter(vs, totalRead, maxToRead)
+                inputMode<STREAM>(),
+                inputFilter(vs, totalRead, *sizer, maxToRead)
                 ) &
                 // Insert filter inserts readsize chunks of vectors into streaming EM-tree in parallel
                 tbb::make_filter < vector < SVector<bool>*>*, void>(
                 tbb::filter::parallel,
                 [&] (vector < SVector<bool>*>* data) -> void {
+                    tbb::tick_count start = tbb::tick_count::now();
                     insert(*data);
+                    sizer->record(*data, (tbb::tick_count::now() - start).seconds());
                     vs.free(data);
                             delete data;
                 }
         )
         );
+        mergeAccumulators();
 
         return totalRead;
     }
 
     /**
-     * Insert is thread safe. Shared accumulators are locked.
+     * Insert is thread safe. Shared accumulators are locked unless thread
+     * local accumulators are enabled. Insert only updates the leaves, so
+     * mergeAccumulators() must be called before statistics are read from the
+     * tree.
      */
     void insert(vector<T*>& data) {
         for (T* object : data) {
@@ -120,15 +225,211 @@ public:
     }
 
     int prune() {
-        return prune(_root);
+        mergeAccumulators();
+        int pruned = prune(_root);
+        packKeys(_root);
+        return pruned;
     }
 
     void update() {
+        mergeAccumulators();
         update(_root);
+        packKeys(_root);
+    }
+
+    /**
+     * Packed keys store the keys of each node in one contiguous KeyMatrix for
+     * faster nearest neighbor search. They are enabled by default.
+     */
+    void setPackedKeys(const bool packedKeys) {
+        _packedKeys = packedKeys;
+        packKeys(_root);
     }
 
     void clearAccumulators() {
         clearAccumulators(_root);
+        clearShards();
+        updateStatistics(_root);
+    }
+
+    /**
+     * How many vectors are read from a stream at once. Each chunk is
+     * inserted by one task, so larger chunks mean less overhead per vector
+     * but fewer tasks to balance across threads.
+     */
+    void setReadSize(const int readSize) {
+        _readsize = readSize;
+    }
+
+    /**
+     * The maximum number of chunks read from a stream that can be in memory
+     * at once, which bounds memory use to about readSize * maxTokens vectors.
+     */
+    void setMaxTokens(const int maxTokens) {
+        _maxtokens = maxTokens;
+    }
+
+    /**
+     * In adaptive mode the chunk size is chosen while a stream is processed
+     * so each chunk takes about setTargetChunkSeconds() to process. The read
+     * size is ignored, max tokens is an upper bound, and only a few chunks
+     * per thread are in flight. It is disabled by default.
+     */
+    void setAdaptiveReadSize(const bool adaptiveReadSize) {
+        _adaptiveReadSize = adaptiveReadSize;
+    }
+
+    /**
+     * The bytes that vectors read from a stream may use in adaptive mode,
+     * or 0 for no limit other than the read size and max tokens.
+     */
+    void setMemoryBudget(const size_t memoryBudget) {
+        _memoryBudget = memoryBudget;
+    }
+
+    /**
+     * The number of threads streams are processed on, which sets how many
+     * chunks are in flight in adaptive mode. It should match the
+     * task_scheduler_init in use. 0, the default, means TBB's default number
+     * of threads.
+     */
+    void setThreads(const int threads) {
+        _threads = threads;
+    }
+
+    /**
+     * How long processing a chunk should take in adaptive mode.
+     */
+    void setTargetChunkSeconds(const double targetChunkSeconds) {
+        _targetChunkSeconds = targetChunkSeconds;
+    }
+
+    /**
+     * Thread local accumulators remove locking from the insert path at the
+     * cost of memory for one accumulator per thread for each leaf cluster a
+     * thread has inserted into. They are disabled by default.
+     */
+    void setThreadLocalAccumulators(const bool threadLocalAccumulators) {
+        mergeAccumulators();
+        _threadLocalAccumulators = threadLocalAccumulators;
+    }
+
+    /**
+     * Adds the thread local accumulator shards into the leaves of the tree
+     * and then totals the count and sum of squared errors of the leaves below
+     * every internal key. Leaves are merged in parallel. It must not run
+     * concurrently with insert().
+     */
+    void mergeAccumulators() {
+        if (!_shards.empty()) {
+            vector<AccumulatorKey*> leaves;
+            gatherLeaves(_root, leaves);
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, leaves.size()),
+                    [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                            mergeShards(leaves[i]);
+                        }
+                    }
+            );
+        }
+        updateStatistics(_root);
+    }
+
+    /**
+     * Writes the keys, accumulators, counts and sum of squared errors of the
+     * whole tree, along with progress, so the tree can be restored by load().
+     * Thread local accumulators are merged first. The checkpoint is written
+     * to a temporary file and renamed over filename, so an earlier checkpoint
+     * is never left half written.
+     */
+    void save(const string& filename, const Progress& progress = Progress()) {
+        mergeAccumulators();
+        CheckpointHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, checkpointMagic, sizeof(header.magic));
+        header.version = checkpointVersion;
+        header.dimensions = _root->isEmpty() ? 0 : _root->getKey(0)->key->size();
+        header.iteration = progress.iteration;
+        header.batch = progress.batch;
+        header.vectorsRead = progress.vectorsRead;
+        header.job = progress.job;
+        writeAtomically(filename, [&](ofstream& out) {
+            write(out, header);
+            save(out, _root);
+        });
+    }
+
+    /**
+     * Writes only the leaf accumulators, counts and sums of squared errors.
+     * This is all that changes when vectors are inserted, so in a
+     * distributed run each worker inserts its shard of the data into a copy
+     * of the same tree and saves its accumulators, and one process adds them
+     * all into its copy with addAccumulators() before calling update().
+     */
+    void saveAccumulators(const string& filename) {
+        mergeAccumulators();
+        vector<AccumulatorKey*> leaves;
+        gatherLeaves(_root, leaves);
+        AccumulatorsHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, accumulatorsMagic, sizeof(header.magic));
+        header.version = checkpointVersion;
+        header.dimensions = leaves.empty() ? 0 : leaves[0]->key->size();
+        header.leaves = leaves.size();
+        writeAtomically(filename, [&](ofstream& out) {
+            write(out, header);
+            for (auto accumulatorKey : leaves) {
+                write(out, accumulatorKey->sumSquaredError);
+                write(out, accumulatorKey->count);
+                saveAccumulator(out, *accumulatorKey->accumulator);
+            }
+        });
+    }
+
+    /**
+     * Adds accumulators written by saveAccumulators() into the leaves of this
+     * tree. The tree must have the same structure as the one that saved them.
+     * Leaves are added in parallel.
+     */
+    void addAccumulators(const string& filename) {
+        mergeAccumulators();
+        vector<AccumulatorKey*> leaves;
+        gatherLeaves(_root, leaves);
+        MappedFile file(filename);
+        AccumulatorsHeader header;
+        if (file.size() < sizeof(header)) {
+            throw runtime_error(filename + " is not an accumulator file");
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        if (memcmp(header.magic, accumulatorsMagic, sizeof(header.magic)) != 0
+                || header.version != checkpointVersion) {
+            throw runtime_error(filename + " is not an accumulator file");
+        }
+        const size_t dimensions = leaves.empty() ? 0 : leaves[0]->key->size();
+        if (header.leaves != leaves.size() || header.dimensions != dimensions) {
+            throw runtime_error(filename + " was saved from a different tree");
+        }
+        const size_t recordBytes = sizeof(double) + sizeof(uint64_t)
+                + dimensions * sizeof(uint32_t);
+        if (file.size() != sizeof(header) + leaves.size() * recordBytes) {
+            throw runtime_error(filename + " is truncated or corrupt");
+        }
+        const char* records = file.data() + sizeof(header);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, leaves.size()),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    ACCUMULATOR accumulator(dimensions);
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        const char* data = records + i * recordBytes;
+                        const char* end = data + recordBytes;
+                        AccumulatorKey* accumulatorKey = leaves[i];
+                        accumulatorKey->sumSquaredError += read<double>(data, end);
+                        accumulatorKey->count += read<uint64_t>(data, end);
+                        loadAccumulator(data, accumulator);
+                        mergeAccumulator(*accumulatorKey->accumulator, accumulator);
+                    }
+                }
+        );
+        updateStatistics(_root);
     }
 
     int getMaxLevelCount() const {
@@ -139,6 +440,11 @@ public:
         return clusterCount(_root, depth);
     }
 
+    /**
+     * Statistics are read from the totals in the root, which are up to date
+     * after insert(STREAM&), visit(STREAM&), prune(), mergeAccumulators(),
+     * addAccumulators() and load().
+     */
     uint64_t getObjCount() const {
         return objCount(_root);
     }
@@ -154,9 +460,73 @@ public:
 private:
     typedef tbb::mutex Mutex;
 
+    /**
+     * A checkpoint is this header followed by the nodes of the tree in
+     * preorder. A node is its size and whether it is a leaf as two uint64_t,
+     * then for each key the key written by Serializer<T>. Each leaf key is
+     * followed by its sum of squared errors as a double, its count as a
+     * uint64_t and its accumulator as written by saveAccumulator(). Each
+     * internal key is followed by its child.
+     */
+    struct CheckpointHeader {
+        char magic[8];
+        uint64_t version;
+        uint64_t dimensions;
+        uint64_t iteration;
+        uint64_t batch;
+        uint64_t vectorsRead;
+        uint64_t job;
+        uint64_t reserved[1];
+    };
+
+    static constexpr const char* checkpointMagic = "LMWSEMT\n";
+    static const uint64_t checkpointVersion = 1;
+
+    /**
+     * An accumulator file is this header followed by a record for each leaf
+     * key in preorder holding its sum of squared errors as a double, its
+     * count as a uint64_t and its accumulator as written by saveAccumulator().
+     */
+    struct AccumulatorsHeader {
+        char magic[8];
+        uint64_t version;
+        uint64_t dimensions;
+        uint64_t leaves;
+    };
+
+    static constexpr const char* accumulatorsMagic = "LMWACCU\n";
+
+    // Used by load().
+    StreamingEMTree() : _root(new Node<AccumulatorKey>()) {
+        _root->setOwnsKeys(true);
+    }
+
+    static CheckpointHeader loadHeader(const MappedFile& file,
+            const string& filename) {
+        CheckpointHeader header;
+        if (file.size() < sizeof(header)) {
+            throw runtime_error(filename + " is not a checkpoint");
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        if (memcmp(header.magic, checkpointMagic, sizeof(header.magic)) != 0
+                || header.version != checkpointVersion) {
+            throw runtime_error(filename + " is not a checkpoint");
+        }
+        return header;
+    }
+
+    static Progress progressOf(const CheckpointHeader& header) {
+        Progress progress;
+        progress.iteration = header.iteration;
+        progress.batch = header.batch;
+        progress.vectorsRead = header.vectorsRead;
+        progress.job = header.job;
+        return progress;
+    }
+
     struct AccumulatorKey {
         AccumulatorKey() : key(NULL), sumSquaredError(0), accumulator(NULL),
-                count(0),  mutex(NULL) { }
+                count(0),  mutex(NULL), leafIndex(0) { }
 
         ~AccumulatorKey() {
             if (key) {
@@ -175,8 +545,23 @@ private:
         ACCUMULATOR* accumulator; // accumulator for partially updated key
         uint64_t count; // how many vectors have been added to accumulator
         Mutex* mutex;
+        size_t leafIndex; // index of the thread local shard for this leaf
     };
 
+    /**
+     * A thread's private part of the accumulator for a leaf. The accumulator
+     * is allocated the first time a thread inserts into the leaf.
+     */
+    struct AccumulatorShard {
+        AccumulatorShard() : sumSquaredError(0), accumulator(NULL), count(0) { }
+
+        double sumSquaredError;
+        ACCUMULATOR* accumulator;
+        uint64_t count;
+    };
+
+    typedef tbb::enumerable_thread_specific<vector<AccumulatorShard>> Shards;
+
     struct Accessor {
         T* operator()(AccumulatorKey* accumulatorKey) const {
             return accumulatorKey->key;
@@ -199,11 +584,12 @@ private:
 
     Nearest<AccumulatorKey> nearestKey(const T* object,
             const Node<AccumulatorKey>* node) const {
-        return _optimizer.nearest(object, node->getKeys(), _accessor);
+        return _optimizer.nearest(object, node->getKeys(), _accessor,
+                node->getKeyMatrix());
     }
 
     void visit(const Node<AccumulatorKey>* node, const T* object,
-            InsertVisitor<T>& visitor, const int level = 1) const {
+            InsertVisitor<T>& visitor, const int level = 1) {
         auto nearest = nearestKey(object, node);
         auto accumulatorKey = nearest.key;
         visitor.accept(level, object, accumulatorKey->key, nearest.distance);
@@ -222,20 +608,82 @@ private:
         auto nearest = nearestKey(object, node);
         if (node->isLeaf()) {
             // update stats and accumulators
+            // keys only change in update() so the distance is calculated
+            // before taking the lock
             auto accumulatorKey = nearest.key;
-            Mutex::scoped_lock lock(*accumulatorKey->mutex);
-            T* key = accumulatorKey->key;
-            accumulatorKey->sumSquaredError += _optimizer.squaredDistance(object, key);
-            ACCUMULATOR* accumulator = accumulatorKey->accumulator;
-            for (size_t i = 0; i < accumulator->size(); i++) {
-                (*accumulator)[i] += (*object)[i];
+            double squaredDistance = _optimizer.squaredDistance(object,
+                    accumulatorKey->key);
+            if (_threadLocalAccumulators) {
+                AccumulatorShard& shard = localShard(accumulatorKey);
+                shard.sumSquaredError += squaredDistance;
+                accumulate(*shard.accumulator, *object);
+                shard.count++;
+                return;
             }
+            Mutex::scoped_lock lock(*accumulatorKey->mutex);
+            accumulatorKey->sumSquaredError += squaredDistance;
+            accumulate(*accumulatorKey->accumulator, *object);
             accumulatorKey->count++;
         } else {
             insert(node->getChild(nearest.index), object);
         }
     }
 
+    AccumulatorShard& localShard(const AccumulatorKey* accumulatorKey) {
+        vector<AccumulatorShard>& shards = _shards.local();
+        if (shards.empty()) {
+            shards.resize(_leafCount);
+        }
+        AccumulatorShard& shard = shards[accumulatorKey->leafIndex];
+        if (!shard.accumulator) {
+            shard.accumulator = new ACCUMULATOR(accumulatorKey->key->size());
+            shard.accumulator->setAll(0);
+        }
+        return shard;
+    }
+
+    void mergeShards(AccumulatorKey* accumulatorKey) {
+        for (auto& shards : _shards) {
+            if (shards.empty()) {
+                continue;
+            }
+            AccumulatorShard& shard = shards[accumulatorKey->leafIndex];
+            if (shard.count == 0) {
+                continue;
+            }
+            accumulatorKey->sumSquaredError += shard.sumSquaredError;
+            mergeAccumulator(*accumulatorKey->accumulator, *shard.accumulator);
+            accumulatorKey->count += shard.count;
+            shard.sumSquaredError = 0;
+            shard.accumulator->setAll(0);
+            shard.count = 0;
+        }
+    }
+
+    void clearShards() {
+        for (auto& shards : _shards) {
+            for (auto& shard : shards) {
+                if (shard.accumulator) {
+                    shard.accumulator->setAll(0);
+                }
+                shard.sumSquaredError = 0;
+                shard.count = 0;
+            }
+        }
+    }
+
+    void gatherLeaves(Node<AccumulatorKey>* node, vector<AccumulatorKey*>& leaves) {
+        if (node->isLeaf()) {
+            for (auto accumulatorKey : node->getKeys()) {
+                leaves.push_back(accumulatorKey);
+            }
+        } else {
+            for (auto child : node->getChildren()) {
+                gatherLeaves(child, leaves);
+            }
+        }
+    }
+
     int prune(Node<AccumulatorKey>* node) {
         int pruned = 0;
         for (int i = 0; i < node->size(); i++) {
@@ -254,10 +702,7 @@ private:
             uint64_t* totalCount) {
         if (node->isLeaf()) {
             for (auto accumulatorKey : node->getKeys()) {
-                auto accumulator = accumulatorKey->accumulator;
-                for (size_t i = 0; i < accumulator->size(); i++) {
-                    (*total)[i] += (*accumulator)[i];
-                }
+                mergeAccumulator(*total, *accumulatorKey->accumulator);
                 *totalCount += accumulatorKey->count;
             }
         } else {
@@ -310,6 +755,112 @@ private:
         }
     }
 
+    void packKeys(Node<AccumulatorKey>* node) {
+        node->setKeyMatrix(_packedKeys ?
+                KeyPacker<T>::pack(node->getKeys(), _accessor) : NULL);
+        if (!node->isLeaf()) {
+            for (auto child : node->getChildren()) {
+                packKeys(child);
+            }
+        }
+    }
+
+    /**
+     * Writes to a temporary file that is renamed to filename once it is
+     * complete, so readers never see a partially written file.
+     */
+    static void writeAtomically(const string& filename,
+            const std::function<void(ofstream&)>& writer) {
+        const string temporary = filename + ".tmp";
+        {
+            ofstream out(temporary, ios::out | ios::binary | ios::trunc);
+            if (!out) {
+                throw runtime_error("failed to open " + temporary);
+            }
+            writer(out);
+            out.close();
+            if (!out) {
+                throw runtime_error("failed to write " + temporary);
+            }
+        }
+        if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+            throw runtime_error("failed to rename " + temporary + " to " + filename);
+        }
+    }
+
+    template <typename V>
+    static void write(ofstream& out, const V& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename V>
+    static V read(const char*& data, const char* end) {
+        if (size_t(end - data) < sizeof(V)) {
+            throw runtime_error("checkpoint is truncated");
+        }
+        V value;
+        memcpy(&value, data, sizeof(V));
+        data += sizeof(V);
+        return value;
+    }
+
+    void save(ofstream& out, const Node<AccumulatorKey>* node) const {
+        write(out, uint64_t(node->size()));
+        write(out, uint64_t(node->isLeaf()));
+        for (size_t i = 0; i < node->size(); i++) {
+            const AccumulatorKey* accumulatorKey = node->getKey(i);
+            Serializer<T>::write(out, *accumulatorKey->key);
+            if (node->isLeaf()) {
+                write(out, accumulatorKey->sumSquaredError);
+                write(out, accumulatorKey->count);
+                saveAccumulator(out, *accumulatorKey->accumulator);
+            } else {
+                save(out, node->getChild(i));
+            }
+        }
+    }
+
+    const char* load(const char* data, const char* end,
+            Node<AccumulatorKey>* node, const size_t dimensions) {
+        const uint64_t size = read<uint64_t>(data, end);
+        const bool isLeaf = read<uint64_t>(data, end);
+        const size_t keyBytes = Serializer<T>::bytes(dimensions);
+        const size_t accumulatorBytes = dimensions * sizeof(uint32_t);
+        for (uint64_t i = 0; i < size; i++) {
+            if (size_t(end - data) < keyBytes) {
+                throw runtime_error("checkpoint is truncated");
+            }
+            auto accumulatorKey = new AccumulatorKey();
+            accumulatorKey->key = Serializer<T>::read(data, dimensions);
+            data += keyBytes;
+            if (isLeaf) {
+                try {
+                    accumulatorKey->sumSquaredError = read<double>(data, end);
+                    accumulatorKey->count = read<uint64_t>(data, end);
+                } catch (...) {
+                    delete accumulatorKey;
+                    throw;
+                }
+                if (size_t(end - data) < accumulatorBytes) {
+                    delete accumulatorKey;
+                    throw runtime_error("checkpoint is truncated");
+                }
+                accumulatorKey->accumulator = new ACCUMULATOR(dimensions);
+                loadAccumulator(data, *accumulatorKey->accumulator);
+                data += accumulatorBytes;
+                accumulatorKey->mutex = new Mutex();
+                accumulatorKey->leafIndex = _leafCount++;
+                node->add(accumulatorKey);
+            } else {
+                auto child = new Node<AccumulatorKey>();
+                child->setOwnsKeys(true);
+                node->add(accumulatorKey, child);
+                data = load(data, end, child, dimensions);
+            }
+        }
+        return data;
+    }
+
     void clearAccumulators(Node<AccumulatorKey>* node) {
         if (node->isLeaf()) {
             for (auto accumulatorKey : node->getKeys()) {
@@ -338,6 +889,7 @@ private:
                     accumulatorKey->accumulator = new ACCUMULATOR(dimensions);
                     accumulatorKey->accumulator->setAll(0);
                     accumulatorKey->mutex = new Mutex();
+                    accumulatorKey->leafIndex = _leafCount++;
                     dst->add(accumulatorKey);
                 } else {
                     auto newChild = new Node<AccumulatorKey>();
@@ -349,16 +901,37 @@ private:
         }
     }
 
+    /**
+     * Streams that can be read concurrently are read by a parallel input
+     * filter. Others are read by one thread at a time.
+     */
+    template <typename STREAM>
+    static tbb::filter::mode inputMode() {
+        return StreamTraits<STREAM>::concurrent ? tbb::filter::parallel
+                : tbb::filter::serial_out_of_order;
+    }
+
+    ChunkSizer* chunkSizer() const {
+        if (_adaptiveReadSize) {
+            return new ChunkSizer(_maxtokens, _threads, _memoryBudget,
+                    _targetChunkSeconds);
+        } else {
+            return new ChunkSizer(_readsize, _maxtokens);
+        }
+    }
+
+    template <typename STREAM>
     std::function<vector<SVector<bool>*>*(tbb::flow_control&)> inputFilter(
-            SVectorStream<T>& vs, size_t& totalRead, const size_t maxToRead = -1) {
-        return ([&vs, &totalRead, this, maxToRead]
+            STREAM& vs, atomic<size_t>& totalRead, const ChunkSizer& sizer,
+            const size_t maxToRead = -1) const {
+        return ([&vs, &totalRead, &sizer, maxToRead]
                 (tbb::flow_control & fc) -> vector < SVector<bool>*>* {
             if (maxToRead > 0 && totalRead >= maxToRead) {
                 fc.stop();
                 return NULL;
             }
             auto data = new vector<T*>;
-            size_t read = vs.read(_readsize, data);
+            size_t read = vs.read(sizer.readSize(), data);
             if (read == 0) {
                 delete data;
                 fc.stop();
@@ -369,55 +942,50 @@ private:
         });
     }
 
-    double sumSquaredError(const Node<AccumulatorKey>* node, const size_t i) const {
+    /**
+     * Sets the count and sum of squared errors of every internal key to the
+     * totals of its child, bottom up, so the statistics of any cluster are
+     * read without visiting the leaves below it. Leaf keys hold the
+     * statistics gathered by insert().
+     */
+    void updateStatistics(Node<AccumulatorKey>* node) {
         if (node->isLeaf()) {
-            return node->getKey(i)->sumSquaredError;
-        } else {
-            return sumSquaredError(node->getChild(i));
+            return;
+        }
+        for (size_t i = 0; i < node->size(); i++) {
+            auto child = node->getChild(i);
+            updateStatistics(child);
+            auto accumulatorKey = node->getKey(i);
+            accumulatorKey->sumSquaredError = sumSquaredError(child);
+            accumulatorKey->count = objCount(child);
         }
     }
 
+    double sumSquaredError(const Node<AccumulatorKey>* node, const size_t i) const {
+        return node->getKey(i)->sumSquaredError;
+    }
+
     double sumSquaredError(const Node<AccumulatorKey>* node) const {
-        if (node->isLeaf()) {
-            double localSum = 0;
-            for (auto key : node->getKeys()) {
-                localSum += key->sumSquaredError;
-            }
-            return localSum;
-        } else {
-            double localSum = 0;
-            for (auto child : node->getChildren()) {
-                localSum += sumSquaredError(child);
-            }
-            return localSum;
+        double localSum = 0;
+        for (auto key : node->getKeys()) {
+            localSum += key->sumSquaredError;
         }
+        return localSum;
     }
 
     /**
      * Object count for cluster i in node.
      */
     uint64_t objCount(const Node<AccumulatorKey>* node, const size_t i) const {
-        if (node->isLeaf()) {
-            return node->getKey(i)->count;
-        } else {
-            return objCount(node->getChild(i));
-        }
+        return node->getKey(i)->count;
     }
 
     uint64_t objCount(const Node<AccumulatorKey>* node) const {
-        if (node->isLeaf()) {
-            uint64_t localCount = 0;
-            for (auto key : node->getKeys()) {
-                localCount += key->count;
-            }
-            return localCount;
-        } else {
-            uint64_t localCount = 0;
-            for (auto child : node->getChildren()) {
-                localCount += objCount(child);
-            }
-            return localCount;
+        uint64_t localCount = 0;
+        for (auto key : node->getKeys()) {
+            localCount += key->count;
         }
+        return localCount;
     }
 
     int maxLevelCount(const Node<AccumulatorKey>* current) const {
@@ -448,11 +1016,35 @@ private:
     OPTIMIZER _optimizer;
     Accessor _accessor;
 
+    // Search keys packed into a KeyMatrix in each node.
+    bool _packedKeys = true;
+
+    // Insert into per thread accumulator shards rather than locking leaves.
+    bool _threadLocalAccumulators = false;
+
+    // The number of leaf clusters created, including any that were pruned.
+    size_t _leafCount = 0;
+
+    // Thread local accumulators for each leaf cluster, indexed by leafIndex.
+    Shards _shards;
+
     // How mamny vectors to read at once when processing a stream.
     int _readsize = 1000;
 
     // The maximum number of readsize vector chunks that can be loaded at once.
     int _maxtokens = 1024;
+
+    // Tune the read size to the measured chunk processing time.
+    bool _adaptiveReadSize = false;
+
+    // Bytes of stream vectors in memory at once in adaptive mode, 0 if unlimited.
+    size_t _memoryBudget = 0;
+
+    // The processing time per chunk aimed for in adaptive mode.
+    double _targetChunkSeconds = 0.002;
+
+    // Threads processing streams, 0 for TBB's default.
+    int _threads = 0;
 };
 
 } // namespace lmw
@@ -21,16 +21,20 @@ public:
         delete _root;
     }
 
+    /**
+     * The counts and sum of squared errors cached in the nodes describe the
+     * tree as cluster() built it, not changes made through this root.
+     */
     Node<T>* getMWayTree() {
         return _root;
     }
 
     int getClusterCount() {
-        return clusterCount(_root);
+        return _root->getClusterCount();
     }
 
     uint64_t getObjCount() {
-        return objCount(_root);
+        return _root->getObjCount();
     }
 
     int getLevelCount() {
@@ -60,6 +64,19 @@ public:
         // spawn parallel tasks for recursion when building the tree
         TSVQTask *t = new(tbb::task::allocate_root()) TSVQTask(_root, _m, _depth, _maxIters);
         tbb::task::spawn_root_and_wait(*t);
+        _root->updateCountsRecursively();
+        _root->setSumSquaredError(-1);
+        packKeys(_root);
+    }
+
+    /**
+     * Packed keys store the keys of each internal node in one contiguous
+     * KeyMatrix so that trees built from getMWayTree() search faster. They
+     * are enabled by default.
+     */
+    void setPackedKeys(const bool packedKeys) {
+        _packedKeys = packedKeys;
+        packKeys(_root);
     }
 
     double getRMSE() {
@@ -142,8 +159,21 @@ private:
         Node<T> *_current;
     };
 
+    void packKeys(Node<T>* n) {
+        if (n->isLeaf()) {
+            return;
+        }
+        n->setKeyMatrix(_packedKeys ? KeyPacker<T>::pack(n->getKeys()) : NULL);
+        for (Node<T>* child : n->getChildren()) {
+            packKeys(child);
+        }
+    }
+
     double RMSE() {
-        double RMSE = sumSquaredError(NULL, _root);
+        if (_root->getSumSquaredError() < 0) {
+            _root->setSumSquaredError(sumSquaredError(NULL, _root));
+        }
+        double RMSE = _root->getSumSquaredError();
         uint64_t size = getObjCount();
         RMSE /= size;
         RMSE = sqrt(RMSE);
@@ -174,37 +204,6 @@ private:
         return distance;
     }
 
-    uint64_t objCount(Node<T>* current) {
-        if (current->isLeaf()) {
-            return current->size();
-        } else {
-            uint64_t localCount = 0;
-            vector<Node<T>*>& children = current->getChildren();
-            for (Node<T> *child : children) {
-                localCount += objCount(child);
-
-            }
-            return localCount;
-        }
-    }
-
-    int clusterCount(Node<T>* current) {
-        if (current->isLeaf()) {
-            if (current->isEmpty()) {
-                return 0;
-            } else {
-                return 1;
-            }
-        } else {
-            int localCount = 0;
-            vector<Node<T>*>& children = current->getChildren();
-            for (Node<T> *child : children) {
-                localCount += clusterCount(child);
-            }
-            return localCount;
-        }
-    }
-
     int levelCount(Node<T>* current) {
         if (current->isLeaf()) {
             return 1;
@@ -259,6 +258,9 @@ private:
     int _maxIters;
     
     DISTANCE _distance;
+
+    // Pack keys of internal nodes into a KeyMatrix.
+    bool _packedKeys = true;
 };
 
 } // namespace lmw